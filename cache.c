@@ -0,0 +1,410 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "memory.h"
+#include "object.h"
+#include "verify.h"
+#include "vm.h"
+
+// Bump whenever the opcode set or the file layout changes.
+#define CACHE_VERSION 2
+#define CACHE_MAGIC "LOXC"
+
+// The header is followed by the line table and the code, which are used in
+// place from the mapping, and then by the constants and the names of the
+// global slots the code refers to, which are read out into the VM.
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint32_t code_count;
+    uint32_t line_count;
+    uint32_t constant_count;
+    uint32_t global_count;
+    uint32_t max_stack;
+    uint32_t padding;
+} CacheHeader;
+
+enum
+{
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+};
+
+typedef struct
+{
+    const uint8_t *current;
+    const uint8_t *end;
+} Reader;
+
+// 64-bit FNV-1a. Sources are hashed once per run, so this needn't be fast.
+uint64_t cache_key(const char *source)
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    for (const char *c = source; *c != '\0'; c++)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+static char *cache_path(const char *path, uint64_t key)
+{
+    const char *dir = getenv("VM_CACHE_DIR");
+    size_t size = (dir != NULL ? strlen(dir) + 32 : strlen(path) + 2);
+    char *cache = (char *)malloc(size);
+
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    if (dir != NULL)
+    {
+        snprintf(cache, size, "%s/%016llx.loxc", dir, (unsigned long long)key);
+    }
+    else
+    {
+        snprintf(cache, size, "%sc", path);
+    }
+
+    return cache;
+}
+
+static bool read_bytes(Reader *reader, void *bytes, size_t size)
+{
+    if ((size_t)(reader->end - reader->current) < size)
+    {
+        return false;
+    }
+
+    memcpy(bytes, reader->current, size);
+    reader->current += size;
+    return true;
+}
+
+// Returns the next length-prefixed string in place, or NULL if it runs past
+// the end of the file.
+static const char *read_string(Reader *reader, uint32_t *length)
+{
+    if (!read_bytes(reader, length, sizeof(*length)) || (size_t)(reader->end - reader->current) < *length)
+    {
+        return NULL;
+    }
+
+    const char *chars = (const char *)reader->current;
+    reader->current += *length;
+    return chars;
+}
+
+static bool load_constants(VM *vm, Reader *reader, uint32_t count, Chunk *chunk)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint8_t type;
+
+        if (!read_bytes(reader, &type, sizeof(type)))
+        {
+            return false;
+        }
+
+        if (type == CONSTANT_NUMBER)
+        {
+            double number;
+
+            if (!read_bytes(reader, &number, sizeof(number)))
+            {
+                return false;
+            }
+
+            chunk_add_constant(vm, chunk, NUMBER_VAL(number));
+        }
+        else if (type == CONSTANT_STRING)
+        {
+            uint32_t length;
+            const char *chars = read_string(reader, &length);
+
+            if (chars == NULL)
+            {
+                return false;
+            }
+
+            chunk_add_constant(vm, chunk, OBJ_VAL(copy_string(vm, chars, (int)length)));
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// The code refers to globals by slot, so the cache is only usable if each
+// name gets back the slot it had when the file was written.
+static bool load_globals(VM *vm, Reader *reader, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t length;
+        const char *chars = read_string(reader, &length);
+
+        if (chars == NULL || vm_global_slot(vm, copy_string(vm, chars, (int)length)) != (int)i)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool cache_load(VM *vm, const char *path, uint64_t key, Chunk *chunk)
+{
+    char *cache = cache_path(path, key);
+
+    if (cache == NULL)
+    {
+        return false;
+    }
+
+    int fd = open(cache, O_RDONLY);
+    free(cache);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat info;
+
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(CacheHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)info.st_size;
+    // Private and writable so the VM can quicken instructions in place
+    // without the changes reaching the file.
+    uint8_t *mapping = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+    {
+        return false;
+    }
+
+    CacheHeader header;
+    memcpy(&header, mapping, sizeof(header));
+    size_t code_start = sizeof(CacheHeader) + (size_t)header.line_count * sizeof(LineStart);
+
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != CACHE_VERSION ||
+        header.key != key || header.code_count == 0 || header.line_count == 0 ||
+        code_start + header.code_count > size)
+    {
+        munmap(mapping, size);
+        return false;
+    }
+
+    chunk->mapping = mapping;
+    chunk->mapping_size = size;
+    chunk->lines = (LineStart *)(mapping + sizeof(CacheHeader));
+    chunk->line_count = (int)header.line_count;
+    chunk->code = mapping + code_start;
+    chunk->count = (int)header.code_count;
+    chunk->max_stack = (int)header.max_stack;
+
+    Reader reader = {chunk->code + chunk->count, mapping + size};
+
+    // Running out of memory while loading makes it a cache miss, leaving
+    // compiling the source to report it.
+    jmp_buf recover;
+    jmp_buf *outer = vm->out_of_memory;
+    bool loaded = false;
+
+    vm->out_of_memory = &recover;
+    // The chunk's constants are only roots while it is the VM's chunk.
+    vm->chunk = chunk;
+
+    if (setjmp(recover) == 0)
+    {
+        loaded = load_constants(vm, &reader, header.constant_count, chunk) &&
+                 load_globals(vm, &reader, header.global_count);
+    }
+
+    vm->chunk = NULL;
+    vm->out_of_memory = outer;
+
+    // A corrupt or stale file is recompiled rather than trusted.
+    loaded = loaded && verify_chunk(vm, chunk, NULL);
+
+    if (!loaded)
+    {
+        chunk_free(vm, chunk);
+    }
+
+    return loaded;
+}
+
+static void write_string(FILE *file, ObjString *string)
+{
+    uint32_t length = (uint32_t)string->length;
+    fwrite(&length, sizeof(length), 1, file);
+    fwrite(string->chars, 1, string->length, file);
+}
+
+static void write_constant(VM *vm, FILE *file, Value value)
+{
+    uint8_t type;
+
+    if (IS_NUMBER(value))
+    {
+        double number = AS_NUMBER(value);
+        type = CONSTANT_NUMBER;
+        fwrite(&type, sizeof(type), 1, file);
+        fwrite(&number, sizeof(number), 1, file);
+    }
+    else
+    {
+        type = CONSTANT_STRING;
+        fwrite(&type, sizeof(type), 1, file);
+        write_string(file, flatten(vm, AS_OBJ(value)));
+    }
+}
+
+static bool write_globals(VM *vm, FILE *file)
+{
+    int count = vm->global_values.count;
+    ObjString **names = (ObjString **)calloc(count > 0 ? count : 1, sizeof(ObjString *));
+
+    if (names == NULL)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < vm->global_names.capacity; i++)
+    {
+        Entry *entry = &vm->global_names.entries[i];
+
+        if (entry->key != NULL)
+        {
+            names[(int)AS_NUMBER(entry->value)] = entry->key;
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        write_string(file, names[i]);
+    }
+
+    free(names);
+    return true;
+}
+
+void cache_write(VM *vm, const char *path, uint64_t key, Chunk *chunk)
+{
+    char *cache = cache_path(path, key);
+    const char *dir = getenv("VM_CACHE_DIR");
+
+    if (cache == NULL)
+    {
+        return;
+    }
+
+    // A missing cache directory is created. Setting VM_CACHE_DIR asks for a
+    // cache, so not being able to write there is reported rather than left
+    // to recompile every run. Next to the source it isn't, since scripts
+    // may well live somewhere read-only.
+    if (dir != NULL)
+    {
+        mkdir(dir, 0777);
+    }
+
+    // Written under a temporary name and renamed into place so concurrent
+    // runs never map a half-written file.
+    size_t temp_size = strlen(cache) + 32;
+    char *temp = (char *)malloc(temp_size);
+    FILE *file = NULL;
+
+    if (temp != NULL)
+    {
+        snprintf(temp, temp_size, "%s.%ld.tmp", cache, (long)getpid());
+        file = fopen(temp, "wb");
+    }
+
+    if (file == NULL)
+    {
+        if (temp != NULL && dir != NULL)
+        {
+            fprintf(stderr, "Could not write cache file \"%s\".\n", cache);
+        }
+
+        free(temp);
+        free(cache);
+        return;
+    }
+
+    CacheHeader header;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.key = key;
+    header.code_count = (uint32_t)chunk->count;
+    header.line_count = (uint32_t)chunk->line_count;
+    header.constant_count = (uint32_t)chunk->constants.count;
+    header.global_count = (uint32_t)vm->global_values.count;
+    header.max_stack = (uint32_t)chunk->max_stack;
+    header.padding = 0;
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(chunk->lines, sizeof(LineStart), chunk->line_count, file);
+    fwrite(chunk->code, 1, chunk->count, file);
+
+    // Flattening a rope constant allocates, so root the constants meanwhile.
+    // Running out of memory just leaves the script uncached.
+    jmp_buf recover;
+    jmp_buf *outer = vm->out_of_memory;
+    bool written = false;
+
+    vm->out_of_memory = &recover;
+    vm->chunk = chunk;
+
+    if (setjmp(recover) == 0)
+    {
+        for (int i = 0; i < chunk->constants.count; i++)
+        {
+            write_constant(vm, file, chunk->constants.values[i]);
+        }
+
+        written = write_globals(vm, file) && !ferror(file);
+    }
+
+    vm->chunk = NULL;
+    vm->out_of_memory = outer;
+
+    written = fclose(file) == 0 && written;
+
+    if (!written || rename(temp, cache) != 0)
+    {
+        remove(temp);
+    }
+
+    free(temp);
+    free(cache);
+}
+
+void cache_unmap(Chunk *chunk)
+{
+    munmap(chunk->mapping, chunk->mapping_size);
+    chunk->mapping = NULL;
+    chunk->mapping_size = 0;
+}
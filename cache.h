@@ -0,0 +1,15 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "chunk.h"
+
+// Compiled chunks are cached in a file next to the source (foo.lox ->
+// foo.loxc), or in $VM_CACHE_DIR named after the source's hash when that is
+// set. Either way the file records the hash of the source it was compiled
+// from and is ignored unless it matches.
+uint64_t cache_key(const char *source);
+bool cache_load(VM *vm, const char *path, uint64_t key, Chunk *chunk);
+void cache_write(VM *vm, const char *path, uint64_t key, Chunk *chunk);
+void cache_unmap(Chunk *chunk);
+
+#endif
@@ -1,43 +1,115 @@
 #include "common.h"
+#include "cache.h"
 #include "chunk.h"
 #include "memory.h"
 #include "value.h"
+#include "vm.h"
 
 void chunk_init(Chunk *chunk)
 {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->line_count = 0;
+    chunk->line_capacity = 0;
     chunk->lines = NULL;
     value_array_init(&chunk->constants);
+    chunk->max_stack = 0;
+    chunk->mapping = NULL;
+    chunk->mapping_size = 0;
+    chunk->verified = false;
 }
 
-void chunk_free(Chunk *chunk)
+void chunk_free(VM *vm, Chunk *chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    value_array_free(&chunk->constants);
+    if (chunk->mapping != NULL)
+    {
+        cache_unmap(chunk);
+    }
+    else
+    {
+        FREE_ARRAY(vm, MEMORY_CODE, uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(vm, MEMORY_LINES, LineStart, chunk->lines, chunk->line_capacity);
+    }
+    value_array_free(vm, MEMORY_CONSTANTS, &chunk->constants);
 
     chunk_init(chunk);
 }
 
-void chunk_write(Chunk *chunk, uint8_t byte, int line)
+void chunk_write(VM *vm, Chunk *chunk, uint8_t byte, int line)
 {
     if (chunk->capacity < chunk->count + 1)
     {
-        int old_capacity = chunk->capacity;
-        chunk->capacity = GROW_CAPACITY(old_capacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, old_capacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, old_capacity, chunk->capacity);
+        int capacity = GROW_CAPACITY(chunk->capacity);
+        chunk->code = GROW_ARRAY(vm, MEMORY_CODE, uint8_t, chunk->code, chunk->capacity, capacity);
+        chunk->capacity = capacity;
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
+    chunk_add_line(vm, chunk, chunk->count, line);
     chunk->count++;
 }
 
-int chunk_add_constant(Chunk *chunk, Value value)
+// Records that the code from offset onwards is on line, starting a new run
+// only when the line changes. Offsets must be added in increasing order.
+void chunk_add_line(VM *vm, Chunk *chunk, int offset, int line)
+{
+    if (chunk->line_count > 0 && chunk->lines[chunk->line_count - 1].line == line)
+    {
+        return;
+    }
+
+    if (chunk->line_capacity < chunk->line_count + 1)
+    {
+        int capacity = GROW_CAPACITY(chunk->line_capacity);
+        chunk->lines = GROW_ARRAY(vm, MEMORY_LINES, LineStart, chunk->lines, chunk->line_capacity, capacity);
+        chunk->line_capacity = capacity;
+    }
+
+    LineStart *start = &chunk->lines[chunk->line_count++];
+    start->offset = offset;
+    start->line = line;
+}
+
+int chunk_get_line(Chunk *chunk, int offset)
+{
+    // Find the last run starting at or before offset.
+    int low = 0;
+    int high = chunk->line_count - 1;
+
+    while (low < high)
+    {
+        int mid = low + (high - low + 1) / 2;
+
+        if (chunk->lines[mid].offset <= offset)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+
+    return chunk->lines[low].line;
+}
+
+// Drops all code from count onwards along with its line runs.
+void chunk_truncate(Chunk *chunk, int count)
+{
+    chunk->count = count;
+
+    while (chunk->line_count > 0 && chunk->lines[chunk->line_count - 1].offset >= count)
+    {
+        chunk->line_count--;
+    }
+}
+
+int chunk_add_constant(VM *vm, Chunk *chunk, Value value)
 {
-    value_array_write(&chunk->constants, value);
+    // Growing the constant array can collect, so keep the value reachable.
+    push(vm, value);
+    value_array_write(vm, MEMORY_CONSTANTS, &chunk->constants, value);
+    pop(vm);
     return chunk->constants.count - 1; // return the index of the constant
 }
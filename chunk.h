@@ -24,20 +24,60 @@ typedef enum
     OP_POP,
     OP_DEFINE_GLOBAL,
     OP_GET_GLOBAL,
+    // long forms with a 24-bit big-endian operand
+    OP_CONSTANT_LONG,
+    OP_DEFINE_GLOBAL_LONG,
+    OP_GET_GLOBAL_LONG,
+    // superinstructions produced by the peephole pass
+    OP_NOT_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
+    OP_ADD_CONSTANT,
+    OP_SUBTRACT_CONSTANT,
+    OP_MULTIPLY_CONSTANT,
+    OP_DIVIDE_CONSTANT,
+    OP_CONCAT_N,
+    // type-specialised forms the VM rewrites generic opcodes into
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_EQUAL_NUM,
+    OP_NOT_EQUAL_NUM,
+    // Not an opcode: how many there are.
+    OP_COUNT,
 } OpCode;
 
+// Line numbers are run-length encoded: each LineStart gives the line of the
+// code from its offset up to the next entry's offset.
+typedef struct
+{
+    int offset;
+    int line;
+} LineStart;
+
 typedef struct
 {
     int count;
     int capacity;
     uint8_t *code;
-    int *lines;
+    int line_count;
+    int line_capacity;
+    LineStart *lines;
     ValueArray constants;
+    // The deepest the operand stack gets while running the code.
+    int max_stack;
+    // Set when code and lines point into a mapped cache file.
+    void *mapping;
+    size_t mapping_size;
+    // Set by verify_chunk() once the code is known to be safe to run.
+    bool verified;
 } Chunk;
 
 void chunk_init(Chunk *chunk);
-void chunk_free(Chunk *chunk);
-void chunk_write(Chunk *chunk, uint8_t byte, int line);
-int chunk_add_constant(Chunk *chunk, Value value);
+void chunk_free(VM *vm, Chunk *chunk);
+void chunk_write(VM *vm, Chunk *chunk, uint8_t byte, int line);
+void chunk_add_line(VM *vm, Chunk *chunk, int offset, int line);
+int chunk_get_line(Chunk *chunk, int offset);
+void chunk_truncate(Chunk *chunk, int count);
+int chunk_add_constant(VM *vm, Chunk *chunk, Value value);
 
 #endif
\ No newline at end of file
@@ -5,4 +5,30 @@
 #include <stdint.h>
 #include <stddef.h>
 
-#endif
\ No newline at end of file
+// Threaded dispatch relies on the GCC/Clang labels-as-values extension.
+// Build with -DNO_COMPUTED_GOTO to force the portable switch loop.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Every function that touches interpreter state takes the VM it belongs to,
+// so separate VMs can run side by side, one per thread.
+typedef struct VM VM;
+
+// What the memory a VM allocates is used for, for its memory statistics.
+typedef enum
+{
+    MEMORY_CODE,
+    MEMORY_LINES,
+    MEMORY_CONSTANTS,
+    MEMORY_STRINGS,
+    MEMORY_TABLES,
+    MEMORY_OBJECTS,
+    // Heap pages not holding a live object.
+    MEMORY_HEAP_FREE,
+    MEMORY_STACK,
+    MEMORY_OTHER,
+    MEMORY_CATEGORY_COUNT
+} MemoryCategory;
+
+#endif
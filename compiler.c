@@ -4,21 +4,23 @@
 #include <string.h>
 #include <stdlib.h>
 #include "scanner.h"
+#include "memory.h"
 #include "object.h"
+#include "peephole.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
-Parser parser;
-Chunk *compiling_chunk;
+#define MAX_LONG_OPERAND 0xffffff
 
-static void error_at(Token *token, const char *message)
+static void error_at(Compiler *compiler, Token *token, const char *message)
 {
-    if (parser.panic_mode)
+    if (compiler->parser.panic_mode)
         return;
 
-    parser.panic_mode = true;
+    compiler->parser.panic_mode = true;
 
     fprintf(stderr, "[line %d] Error", token->line);
 
@@ -36,151 +38,290 @@ static void error_at(Token *token, const char *message)
     }
 
     fprintf(stderr, ": %s\n", message);
-    parser.had_error = true;
+    compiler->parser.had_error = true;
 }
 
-static void error(const char *message)
+static void error(Compiler *compiler, const char *message)
 {
-    error_at(&parser.previous, message);
+    error_at(compiler, &compiler->parser.previous, message);
 }
 
-static void error_at_current(const char *message)
+static void error_at_current(Compiler *compiler, const char *message)
 {
-    error_at(&parser.current, message);
+    error_at(compiler, &compiler->parser.current, message);
 }
 
-static void advance()
+static void advance(Compiler *compiler)
 {
-    parser.previous = parser.current;
+    compiler->parser.previous = compiler->parser.current;
 
     for (;;)
     {
-        parser.current = scan_token();
+        compiler->parser.current = scan_token(&compiler->scanner);
 
-        if (parser.current.type != TOKEN_ERROR)
+        if (compiler->parser.current.type != TOKEN_ERROR)
             break;
 
-        error_at_current(parser.current.start);
+        error_at_current(compiler, compiler->parser.current.start);
     }
 }
 
-static void consume(TokenType type, const char *message)
+static void consume(Compiler *compiler, TokenType type, const char *message)
 {
-    if (parser.current.type == type)
+    if (compiler->parser.current.type == type)
     {
-        advance();
+        advance(compiler);
         return;
     }
 
-    error_at_current(message);
+    error_at_current(compiler, message);
 }
 
-static bool check(TokenType type)
+static bool check(Compiler *compiler, TokenType type)
 {
-    return parser.current.type == type;
+    return compiler->parser.current.type == type;
 }
 
-static bool match(TokenType type)
+static bool match(Compiler *compiler, TokenType type)
 {
-    if (!check(type))
+    if (!check(compiler, type))
     {
         return false;
     }
-    advance();
+    advance(compiler);
     return true;
 }
 
-static Chunk *current_chunk()
+static Chunk *current_chunk(Compiler *compiler)
 {
-    return compiling_chunk;
+    return compiler->chunk;
 }
 
-static void emit_byte(uint8_t byte)
+static void emit_byte(Compiler *compiler, uint8_t byte)
 {
-    chunk_write(current_chunk(), byte, parser.previous.line);
+    chunk_write(compiler->vm, current_chunk(compiler), byte, compiler->parser.previous.line);
 }
 
-static void emit_return()
+// Records the net effect of an instruction on the stack, keeping the chunk's
+// max_stack up to date so the VM can size its stack before running it.
+static void adjust_stack(Compiler *compiler, int effect)
 {
-    emit_byte(OP_RETURN);
+    compiler->stack_depth += effect;
+
+    if (compiler->stack_depth > current_chunk(compiler)->max_stack)
+    {
+        current_chunk(compiler)->max_stack = compiler->stack_depth;
+    }
+}
+
+static void emit_return(Compiler *compiler)
+{
+    emit_byte(compiler, OP_RETURN);
 }
 
-static void end_compiler()
+static void end_compiler(Compiler *compiler)
 {
-    emit_return();
+    emit_return(compiler);
+    peephole_optimize(compiler->vm, current_chunk(compiler));
 
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.had_error)
+    if (!compiler->parser.had_error)
     {
-        chunk_disassemble(current_chunk(), "code");
+        chunk_disassemble(compiler->vm, current_chunk(compiler), "code");
     }
 #endif
 }
 
-static void emit_bytes(uint8_t byte1, uint8_t byte2)
+static void emit_bytes(Compiler *compiler, uint8_t byte1, uint8_t byte2)
+{
+    emit_byte(compiler, byte1);
+    emit_byte(compiler, byte2);
+}
+
+// Emits op with a one byte operand, or long_op with a three byte one.
+static void emit_operand(Compiler *compiler, OpCode op, OpCode long_op, int operand)
+{
+    if (operand <= UINT8_MAX)
+    {
+        emit_bytes(compiler, op, (uint8_t)operand);
+        return;
+    }
+
+    emit_byte(compiler, long_op);
+    emit_byte(compiler, (uint8_t)((operand >> 16) & 0xff));
+    emit_byte(compiler, (uint8_t)((operand >> 8) & 0xff));
+    emit_byte(compiler, (uint8_t)(operand & 0xff));
+}
+
+// Constants are deduplicated by identity: numbers by their bits, so 0 and -0
+// stay distinct, and strings by pointer since they are interned.
+static bool is_dedupable(Value value)
+{
+    return IS_NUMBER(value) || IS_OBJ(value);
+}
+
+static uint64_t constant_bits(Value value)
+{
+    if (IS_NUMBER(value))
+    {
+        double number = AS_NUMBER(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        return bits;
+    }
+
+    return (uint64_t)(uintptr_t)AS_OBJ(value);
+}
+
+static bool same_constant(Value a, Value b)
 {
-    emit_byte(byte1);
-    emit_byte(byte2);
+    return IS_NUMBER(a) == IS_NUMBER(b) && constant_bits(a) == constant_bits(b);
 }
 
-static uint8_t make_constant(Value value)
+static ConstantEntry *find_constant_entry(ConstantEntry *entries, int capacity, Value value)
 {
-    int constant = chunk_add_constant(current_chunk(), value);
+    uint32_t mask = (uint32_t)capacity - 1;
+    uint32_t index = (uint32_t)((constant_bits(value) * 0x9e3779b97f4a7c15ull) >> 32) & mask;
 
-    if (constant > UINT8_MAX)
+    for (;;)
     {
-        error("Too many constants for a single chunk.");
+        ConstantEntry *entry = &entries[index];
+
+        if (entry->index == -1 || same_constant(entry->value, value))
+        {
+            return entry;
+        }
+
+        index = (index + 1) & mask;
+    }
+}
+
+static void grow_constant_map(Compiler *compiler)
+{
+    int capacity = GROW_CAPACITY(compiler->constant_map.capacity);
+    ConstantEntry *entries = ALLOCATE(compiler->vm, MEMORY_CONSTANTS, ConstantEntry, capacity);
+
+    for (int i = 0; i < capacity; i++)
+    {
+        entries[i].index = -1;
+    }
+
+    for (int i = 0; i < compiler->constant_map.capacity; i++)
+    {
+        ConstantEntry *entry = &compiler->constant_map.entries[i];
+
+        if (entry->index != -1)
+        {
+            *find_constant_entry(entries, capacity, entry->value) = *entry;
+        }
+    }
+
+    FREE_ARRAY(compiler->vm, MEMORY_CONSTANTS, ConstantEntry, compiler->constant_map.entries, compiler->constant_map.capacity);
+    compiler->constant_map.entries = entries;
+    compiler->constant_map.capacity = capacity;
+}
+
+static int make_constant(Compiler *compiler, Value value)
+{
+    ValueArray *constants = &current_chunk(compiler)->constants;
+    ConstantEntry *entry = NULL;
+
+    if (is_dedupable(value))
+    {
+        if ((compiler->constant_map.count + 1) * 2 > compiler->constant_map.capacity)
+        {
+            // Growing may collect, and value isn't in the pool yet.
+            push(compiler->vm, value);
+            grow_constant_map(compiler);
+            pop(compiler->vm);
+        }
+
+        entry = find_constant_entry(compiler->constant_map.entries, compiler->constant_map.capacity, value);
+
+        if (entry->index != -1 && entry->index < constants->count &&
+            same_constant(constants->values[entry->index], value))
+        {
+            return entry->index;
+        }
+    }
+
+    int constant = chunk_add_constant(compiler->vm, current_chunk(compiler), value);
+
+    if (constant > MAX_LONG_OPERAND)
+    {
+        error(compiler, "Too many constants for a single chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    if (entry != NULL)
+    {
+        if (entry->index == -1)
+        {
+            compiler->constant_map.count++;
+        }
+
+        entry->value = value;
+        entry->index = constant;
+    }
+
+    return constant;
 }
 
-static void emit_constant(Value value)
+static void emit_constant(Compiler *compiler, Value value)
 {
-    emit_bytes(OP_CONSTANT, make_constant(value));
+    emit_operand(compiler, OP_CONSTANT, OP_CONSTANT_LONG, make_constant(compiler, value));
+    adjust_stack(compiler, 1);
 }
 
-static void number()
+static void number(Compiler *compiler)
 {
-    double value = strtod(parser.previous.start, NULL);
-    emit_constant(NUMBER_VAL(value));
+    double value = strtod(compiler->parser.previous.start, NULL);
+    emit_constant(compiler, NUMBER_VAL(value));
 }
 
-static void parse_precedence(Precedence precedence);
+static void parse_precedence(Compiler *compiler, Precedence precedence);
 
-static uint8_t identifier_constant(Token *name)
+static int global_slot(Compiler *compiler, Token *name)
 {
-    return make_constant(OBJ_VAL(copy_string(name->start, name->length)));
+    int slot = vm_global_slot(compiler->vm, copy_string(compiler->vm, name->start, name->length));
+
+    if (slot > MAX_LONG_OPERAND)
+    {
+        error(compiler, "Too many global variables.");
+        return 0;
+    }
+
+    return slot;
 }
 
-static void expression();
-static void statement();
-static void declaration();
+static void expression(Compiler *compiler);
+static void statement(Compiler *compiler);
+static void declaration(Compiler *compiler);
 static ParseRule *get_rule(TokenType type);
 
-static void expression()
+static void expression(Compiler *compiler)
 {
-    parse_precedence(PREC_ASSIGNMENT);
+    parse_precedence(compiler, PREC_ASSIGNMENT);
 }
 
-static void print_statement()
+static void print_statement(Compiler *compiler)
 {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emit_byte(OP_PRINT);
+    expression(compiler);
+    consume(compiler, TOKEN_SEMICOLON, "Expect ';' after value.");
+    emit_byte(compiler, OP_PRINT);
+    adjust_stack(compiler, -1);
 }
 
-static void synchronize()
+static void synchronize(Compiler *compiler)
 {
-    parser.panic_mode = false;
+    compiler->parser.panic_mode = false;
 
-    while (parser.current.type != TOKEN_EOF)
+    while (compiler->parser.current.type != TOKEN_EOF)
     {
-        if (parser.previous.type == TOKEN_SEMICOLON)
+        if (compiler->parser.previous.type == TOKEN_SEMICOLON)
             return;
 
-        switch (parser.current.type)
+        switch (compiler->parser.current.type)
         {
         case TOKEN_CLASS:
         case TOKEN_DEF:
@@ -195,118 +336,353 @@ static void synchronize()
             ;
         }
 
-        advance();
+        advance(compiler);
+    }
+}
+
+static void expression_statement(Compiler *compiler)
+{
+    expression(compiler);
+    consume(compiler, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    emit_byte(compiler, OP_POP);
+    adjust_stack(compiler, -1);
+}
+
+static void grouping(Compiler *compiler)
+{
+    expression(compiler);
+    consume(compiler, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+}
+
+// Decodes the instruction at offset if it pushes a literal, returning its
+// length, or 0 if it is anything else.
+static int read_literal(Compiler *compiler, int offset, Value *value)
+{
+    Chunk *chunk = current_chunk(compiler);
+
+    switch (chunk->code[offset])
+    {
+    case OP_CONSTANT:
+        *value = chunk->constants.values[chunk->code[offset + 1]];
+        return 2;
+    case OP_CONSTANT_LONG:
+        *value = chunk->constants.values[(chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) |
+                                         chunk->code[offset + 3]];
+        return 4;
+    case OP_NONE:
+        *value = NONE_VAL;
+        return 1;
+    case OP_TRUE:
+        *value = BOOL_VAL(true);
+        return 1;
+    case OP_FALSE:
+        *value = BOOL_VAL(false);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// True if the code from start to the end of the chunk is one literal push.
+static bool is_literal(Compiler *compiler, int start, int end, Value *value)
+{
+    return start < end && read_literal(compiler, start, value) == end - start;
+}
+
+// Shrinks the constant pool back to count entries, giving back any constants
+// added by literals that have just been folded away. Literals that reused an
+// existing constant added nothing, so shared entries are never dropped.
+static void release_constants(Compiler *compiler, int count)
+{
+    current_chunk(compiler)->constants.count = count;
+}
+
+// Drops the code from start onwards and emits a push of value instead.
+static void replace_with_literal(Compiler *compiler, int start, Value value)
+{
+    chunk_truncate(current_chunk(compiler), start);
+
+    if (IS_NONE(value))
+    {
+        emit_byte(compiler, OP_NONE);
+        adjust_stack(compiler, 1);
+    }
+    else if (IS_BOOL(value))
+    {
+        emit_byte(compiler, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+        adjust_stack(compiler, 1);
+    }
+    else
+    {
+        emit_constant(compiler, value);
     }
 }
 
-static void expression_statement()
+static bool is_falsey(Value value)
 {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emit_byte(OP_POP);
+    return IS_NONE(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void grouping()
+// Evaluates a unary operator on a literal the same way the VM would. Returns
+// false when the VM would raise a runtime error, which is left to run.
+static bool fold_unary(TokenType operator_type, Value operand, Value *result)
 {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    switch (operator_type)
+    {
+    case TOKEN_NOT:
+        *result = BOOL_VAL(is_falsey(operand));
+        return true;
+    case TOKEN_MINUS:
+        if (!IS_NUMBER(operand))
+            return false;
+        *result = NUMBER_VAL(-AS_NUMBER(operand));
+        return true;
+    default:
+        return false;
+    }
 }
 
-static void unary()
+static bool fold_binary(Compiler *compiler, TokenType operator_type, Value a, Value b, Value *result)
 {
-    TokenType operator_type = parser.previous.type;
+    if (operator_type == TOKEN_EQUAL_EQUAL)
+    {
+        *result = BOOL_VAL(values_equal(compiler->vm, a, b));
+        return true;
+    }
+    if (operator_type == TOKEN_BANG_EQUAL)
+    {
+        *result = BOOL_VAL(!values_equal(compiler->vm, a, b));
+        return true;
+    }
+
+    if (operator_type == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b))
+    {
+        // Both operands are still in the constant pool, so they stay reachable.
+        ObjString *string = concatenate_strings(compiler->vm, AS_STRING(a), AS_STRING(b));
+        *result = OBJ_VAL(intern_string(compiler->vm, string));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+        return false;
 
-    expression();
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+
+    // Mirrors the opcodes binary() emits, e.g. >= is not(<).
+    switch (operator_type)
+    {
+    case TOKEN_GREATER:
+        *result = BOOL_VAL(x > y);
+        return true;
+    case TOKEN_GREATER_EQUAL:
+        *result = BOOL_VAL(!(x < y));
+        return true;
+    case TOKEN_LESS:
+        *result = BOOL_VAL(x < y);
+        return true;
+    case TOKEN_LESS_EQUAL:
+        *result = BOOL_VAL(!(x > y));
+        return true;
+    case TOKEN_PLUS:
+        *result = NUMBER_VAL(x + y);
+        return true;
+    case TOKEN_MINUS:
+        *result = NUMBER_VAL(x - y);
+        return true;
+    case TOKEN_STAR:
+        *result = NUMBER_VAL(x * y);
+        return true;
+    case TOKEN_SLASH:
+        *result = NUMBER_VAL(x / y);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void emit_concat(Compiler *compiler, int count)
+{
+    emit_bytes(compiler, OP_CONCAT_N, (uint8_t)count);
+    // Operands that aren't all numbers or all strings are added pairwise,
+    // pushing each pair above the rest.
+    adjust_stack(compiler, 2);
+    adjust_stack(compiler, -2 - (count - 1));
+}
+
+// Emits the addition of the two operands on top of the stack. When the
+// right one is a literal added straight after another addition, as in
+// x + y + "a", both become a single OP_CONCAT_N over x, y and "a". That
+// evaluates the literal before x and y are added, which is only safe
+// because a literal can't fail. It also reports every addition's errors on
+// one line, so the literal must be on the line of the addition it joins.
+static void emit_add(Compiler *compiler, int right_start)
+{
+    Chunk *chunk = current_chunk(compiler);
+    int line = compiler->parser.previous.line;
+    Value value;
+
+    if (right_start == compiler->concat_end && line == compiler->concat_line &&
+        compiler->concat_count < UINT8_MAX && is_literal(compiler, right_start, chunk->count, &value))
+    {
+        uint8_t literal[4];
+        int length = chunk->count - right_start;
+        memcpy(literal, &chunk->code[right_start], length);
+
+        // Move the literal ahead of the addition it joins, which leaves
+        // that addition's operands on the stack beneath it.
+        chunk_truncate(chunk, compiler->concat_start);
+        for (int i = 0; i < length; i++)
+        {
+            emit_byte(compiler, literal[i]);
+        }
+
+        adjust_stack(compiler, compiler->concat_count - 1);
+        compiler->concat_start = chunk->count;
+        compiler->concat_count++;
+        emit_concat(compiler, compiler->concat_count);
+    }
+    else
+    {
+        compiler->concat_start = chunk->count;
+        compiler->concat_count = 2;
+        emit_byte(compiler, OP_ADD);
+        adjust_stack(compiler, -1);
+    }
+
+    compiler->concat_end = chunk->count;
+    compiler->concat_line = line;
+}
+
+static void unary(Compiler *compiler)
+{
+    TokenType operator_type = compiler->parser.previous.type;
+    int start = current_chunk(compiler)->count;
+    int constants = current_chunk(compiler)->constants.count;
+
+    expression(compiler);
+
+    Value operand;
+    Value result;
+    if (is_literal(compiler, start, current_chunk(compiler)->count, &operand) && fold_unary(operator_type, operand, &result))
+    {
+        release_constants(compiler, constants);
+        adjust_stack(compiler, -1);
+        replace_with_literal(compiler, start, result);
+        return;
+    }
 
     switch (operator_type)
     {
     case TOKEN_NOT:
-        emit_byte(OP_NOT);
+        emit_byte(compiler, OP_NOT);
         break;
     case TOKEN_MINUS:
-        emit_byte(OP_NEGATE);
+        emit_byte(compiler, OP_NEGATE);
         break;
     default:
         return;
     }
 }
 
-static void binary()
+static void binary(Compiler *compiler)
 {
-    TokenType operator_type = parser.previous.type;
+    TokenType operator_type = compiler->parser.previous.type;
+    int left_start = compiler->operand_start;
+    int left_constants = compiler->operand_constants;
+    int right_start = current_chunk(compiler)->count;
     ParseRule *rule = get_rule(operator_type);
-    parse_precedence((Precedence)(rule->precedence + 1));
+    parse_precedence(compiler, (Precedence)(rule->precedence + 1));
+
+    Value a;
+    Value b;
+    Value result;
+    if (is_literal(compiler, left_start, right_start, &a) && is_literal(compiler, right_start, current_chunk(compiler)->count, &b) &&
+        fold_binary(compiler, operator_type, a, b, &result))
+    {
+        release_constants(compiler, left_constants);
+        adjust_stack(compiler, -2);
+        replace_with_literal(compiler, left_start, result);
+        return;
+    }
+
+    if (operator_type == TOKEN_PLUS)
+    {
+        emit_add(compiler, right_start);
+        return;
+    }
 
     switch (operator_type)
     {
     case TOKEN_BANG_EQUAL:
-        emit_bytes(OP_EQUAL, OP_NOT);
+        emit_bytes(compiler, OP_EQUAL, OP_NOT);
         break;
     case TOKEN_EQUAL_EQUAL:
-        emit_byte(OP_EQUAL);
+        emit_byte(compiler, OP_EQUAL);
         break;
     case TOKEN_GREATER:
-        emit_byte(OP_GREATER);
+        emit_byte(compiler, OP_GREATER);
         break;
     case TOKEN_GREATER_EQUAL:
-        emit_bytes(OP_LESS, OP_NOT);
+        emit_bytes(compiler, OP_LESS, OP_NOT);
         break;
     case TOKEN_LESS:
-        emit_byte(OP_LESS);
+        emit_byte(compiler, OP_LESS);
         break;
     case TOKEN_LESS_EQUAL:
-        emit_bytes(OP_GREATER, OP_NOT);
-        break;
-    case TOKEN_PLUS:
-        emit_byte(OP_ADD);
+        emit_bytes(compiler, OP_GREATER, OP_NOT);
         break;
     case TOKEN_MINUS:
-        emit_byte(OP_SUBTRACT);
+        emit_byte(compiler, OP_SUBTRACT);
         break;
     case TOKEN_STAR:
-        emit_byte(OP_MULTIPLY);
+        emit_byte(compiler, OP_MULTIPLY);
         break;
     case TOKEN_SLASH:
-        emit_byte(OP_DIVIDE);
+        emit_byte(compiler, OP_DIVIDE);
         break;
     default:
         return;
     }
+
+    adjust_stack(compiler, -1);
 }
 
-static void literal()
+static void literal(Compiler *compiler)
 {
-    switch (parser.previous.type)
+    switch (compiler->parser.previous.type)
     {
     case TOKEN_NONE:
-        emit_byte(OP_NONE);
+        emit_byte(compiler, OP_NONE);
         break;
     case TOKEN_TRUE:
-        emit_byte(OP_TRUE);
+        emit_byte(compiler, OP_TRUE);
         break;
     case TOKEN_FALSE:
-        emit_byte(OP_FALSE);
+        emit_byte(compiler, OP_FALSE);
         break;
     default:
         return;
     }
+
+    adjust_stack(compiler, 1);
 }
 
-static void string()
+static void string(Compiler *compiler)
 {
     // trims the quotes
-    emit_constant(OBJ_VAL(copy_string(parser.previous.start + 1, parser.previous.length - 2)));
+    emit_constant(compiler, OBJ_VAL(copy_string(compiler->vm, compiler->parser.previous.start + 1, compiler->parser.previous.length - 2)));
 }
 
-static void named_variable(Token name)
+static void named_variable(Compiler *compiler, Token name)
 {
-    uint8_t arg = identifier_constant(&name);
-    emit_bytes(OP_GET_GLOBAL, arg);
+    emit_operand(compiler, OP_GET_GLOBAL, OP_GET_GLOBAL_LONG, global_slot(compiler, &name));
+    adjust_stack(compiler, 1);
 }
 
-static void variable()
+static void variable(Compiler *compiler)
 {
-    named_variable(parser.previous);
+    named_variable(compiler, compiler->parser.previous);
 }
 
 ParseRule rules[] = {
@@ -356,102 +732,146 @@ static ParseRule *get_rule(TokenType type)
     return &rules[type];
 }
 
-static void parse_precedence(Precedence precedence)
+static void parse_precedence(Compiler *compiler, Precedence precedence)
 {
-    advance();
+    advance(compiler);
 
-    ParseFn prefix_rule = get_rule(parser.previous.type)->prefix;
+    int start = current_chunk(compiler)->count;
+    int constants = current_chunk(compiler)->constants.count;
+    ParseFn prefix_rule = get_rule(compiler->parser.previous.type)->prefix;
 
     if (prefix_rule == NULL)
     {
-        error("Expect expression.");
+        error(compiler, "Expect expression.");
         return;
     }
 
-    prefix_rule();
+    prefix_rule(compiler);
 
-    while (precedence <= get_rule(parser.current.type)->precedence)
+    while (precedence <= get_rule(compiler->parser.current.type)->precedence)
     {
-        advance();
-        ParseFn infix_rule = get_rule(parser.previous.type)->infix;
-        infix_rule();
+        advance(compiler);
+        ParseFn infix_rule = get_rule(compiler->parser.previous.type)->infix;
+        compiler->operand_start = start;
+        compiler->operand_constants = constants;
+        infix_rule(compiler);
     }
 }
 
-static void statement()
+static void statement(Compiler *compiler)
 {
-    if (match(TOKEN_PRINT))
+    if (match(compiler, TOKEN_PRINT))
     {
-        print_statement();
+        print_statement(compiler);
     }
     else
     {
-        expression_statement();
+        expression_statement(compiler);
     }
 }
 
-static uint8_t parse_variable(const char *error_message)
+static int parse_variable(Compiler *compiler, const char *error_message)
 {
-    consume(TOKEN_IDENTIFIER, error_message);
-    return identifier_constant(&parser.previous);
+    consume(compiler, TOKEN_IDENTIFIER, error_message);
+    return global_slot(compiler, &compiler->parser.previous);
 }
 
-static void define_variable(uint8_t global)
+static void define_variable(Compiler *compiler, int global)
 {
-    emit_bytes(OP_DEFINE_GLOBAL, global);
+    emit_operand(compiler, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
+    adjust_stack(compiler, -1);
 }
 
-static void var_declaration()
+static void var_declaration(Compiler *compiler)
 {
-    uint8_t global = parse_variable("Expect variable name.");
+    int global = parse_variable(compiler, "Expect variable name.");
 
-    if (match(TOKEN_EQUAL))
+    if (match(compiler, TOKEN_EQUAL))
     {
-        expression();
+        expression(compiler);
     }
     else
     {
-        emit_byte(OP_NONE);
+        emit_byte(compiler, OP_NONE);
+        adjust_stack(compiler, 1);
     }
 
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    consume(compiler, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
-    define_variable(global);
+    define_variable(compiler, global);
 }
 
-static void declaration()
+static void declaration(Compiler *compiler)
 {
-    if (match(TOKEN_VAR))
+    if (match(compiler, TOKEN_VAR))
     {
-        var_declaration();
+        var_declaration(compiler);
     }
     else
     {
-        statement();
+        statement(compiler);
     }
 
-    if (parser.panic_mode)
+    if (compiler->parser.panic_mode)
     {
-        synchronize();
+        synchronize(compiler);
     }
 }
 
-bool compile(const char *source, Chunk *chunk)
+bool compile(VM *vm, const char *source, Chunk *chunk)
 {
-    scanner_init(source);
-    compiling_chunk = chunk;
+    Compiler compiler;
+    compiler.vm = vm;
+    scanner_init(&compiler.scanner, source);
+    compiler.chunk = chunk;
+    compiler.constant_map.count = 0;
+    compiler.constant_map.capacity = 0;
+    compiler.constant_map.entries = NULL;
+    compiler.stack_depth = 0;
+    compiler.concat_end = -1;
+
+    compiler.parser.had_error = false;
+    compiler.parser.panic_mode = false;
+
+    jmp_buf recover;
+    jmp_buf *outer = vm->out_of_memory;
 
-    parser.had_error = false;
-    parser.panic_mode = false;
+    vm->compiler = &compiler;
+    vm->out_of_memory = &recover;
+
+    if (setjmp(recover) == 0)
+    {
+        advance(&compiler);
 
-    advance();
+        while (!match(&compiler, TOKEN_EOF))
+        {
+            declaration(&compiler);
+        }
 
-    while (!match(TOKEN_EOF))
+        end_compiler(&compiler);
+    }
+    else
     {
-        declaration();
+        // Report it even if the parser was already recovering from an error.
+        compiler.parser.panic_mode = false;
+        error(&compiler, memory_error(vm));
     }
 
-    end_compiler();
+    vm->out_of_memory = outer;
+    vm->compiler = NULL;
+    FREE_ARRAY(vm, MEMORY_CONSTANTS, ConstantEntry, compiler.constant_map.entries, compiler.constant_map.capacity);
+
+    return !compiler.parser.had_error;
+}
 
-    return !parser.had_error;
+void mark_compiler_roots(VM *vm)
+{
+    if (vm->compiler == NULL)
+        return;
+
+    ValueArray *constants = &vm->compiler->chunk->constants;
+    for (int i = 0; i < constants->count; i++)
+    {
+        mark_value(vm, constants->values[i]);
+    }
 }
\ No newline at end of file
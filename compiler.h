@@ -26,7 +26,48 @@ typedef struct
     bool panic_mode;
 } Parser;
 
-typedef void (*ParseFn)();
+// Index of each number and string in the chunk's constant pool, so repeated
+// literals share a slot. Entries aren't removed when folding shrinks the
+// pool; lookups just ignore any whose index no longer holds the same value.
+typedef struct
+{
+    Value value;
+    int index;
+} ConstantEntry;
+
+typedef struct
+{
+    int count;
+    int capacity;
+    ConstantEntry *entries;
+} ConstantMap;
+
+// Everything one compilation needs, so compiles on separate VMs don't share
+// any state.
+typedef struct Compiler
+{
+    VM *vm;
+    Scanner scanner;
+    Parser parser;
+    Chunk *chunk;
+    // Offset of the left operand of the infix expression being compiled,
+    // set by parse_precedence() so binary() can tell whether it was a single
+    // literal, along with the size of the constant pool at that point.
+    int operand_start;
+    int operand_constants;
+    // Depth of the operand stack after the code emitted so far.
+    int stack_depth;
+    // The OP_ADD or OP_CONCAT_N emitted last: its offset, the offset just
+    // past it, how many operands it adds and its line. A literal added
+    // straight after it joins it.
+    int concat_start;
+    int concat_end;
+    int concat_count;
+    int concat_line;
+    ConstantMap constant_map;
+} Compiler;
+
+typedef void (*ParseFn)(Compiler *compiler);
 
 typedef struct
 {
@@ -35,6 +76,7 @@ typedef struct
     Precedence precedence;
 } ParseRule;
 
-bool compile(const char *source, Chunk *chunk);
+bool compile(VM *vm, const char *source, Chunk *chunk);
+void mark_compiler_roots(VM *vm);
 
 #endif
\ No newline at end of file
@@ -1,86 +1,175 @@
 #include "debug.h"
 #include <stdio.h>
+#include "object.h"
+#include "vm.h"
 
-static int constant_instruction(const char *name, Chunk *chunk, int offset)
+// Indexed by opcode, so entries must stay in OpCode order.
+static const char *opcode_names[] = {
+    "OP_CONSTANT",
+    "OP_NONE",
+    "OP_TRUE",
+    "OP_FALSE",
+    "OP_EQUAL",
+    "OP_GREATER",
+    "OP_LESS",
+    "OP_ADD",
+    "OP_SUBTRACT",
+    "OP_MULTIPLY",
+    "OP_DIVIDE",
+    "OP_NOT",
+    "OP_NEGATE",
+    "OP_RETURN",
+    "OP_PRINT",
+    "OP_POP",
+    "OP_DEFINE_GLOBAL",
+    "OP_GET_GLOBAL",
+    "OP_CONSTANT_LONG",
+    "OP_DEFINE_GLOBAL_LONG",
+    "OP_GET_GLOBAL_LONG",
+    "OP_NOT_EQUAL",
+    "OP_GREATER_EQUAL",
+    "OP_LESS_EQUAL",
+    "OP_ADD_CONSTANT",
+    "OP_SUBTRACT_CONSTANT",
+    "OP_MULTIPLY_CONSTANT",
+    "OP_DIVIDE_CONSTANT",
+    "OP_CONCAT_N",
+    "OP_ADD_NUM",
+    "OP_ADD_STR",
+    "OP_EQUAL_NUM",
+    "OP_NOT_EQUAL_NUM",
+};
+
+_Static_assert(sizeof(opcode_names) / sizeof(opcode_names[0]) == OP_COUNT, "opcode_names is missing an opcode");
+
+const char *opcode_name(uint8_t instruction)
+{
+    return instruction < OP_COUNT ? opcode_names[instruction] : "unknown";
+}
+
+static int constant_instruction(VM *vm, const char *name, Chunk *chunk, int offset)
 {
     uint8_t constant = chunk->code[offset + 1];
     printf("%-16s %4d '", name, constant);
-    value_print(chunk->constants.values[constant]);
+    value_print(vm, chunk->constants.values[constant]);
     printf("'\n");
     return offset + 2;
 }
 
+static int global_instruction(VM *vm, const char *name, Chunk *chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    ObjString *global = vm_global_name(vm, slot);
+    printf("%-16s %4d '%s'\n", name, slot, global != NULL ? global->chars : "?");
+    return offset + 2;
+}
+
+static int byte_instruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t operand = chunk->code[offset + 1];
+    printf("%-16s %4d\n", name, operand);
+    return offset + 2;
+}
+
+static int long_operand(Chunk *chunk, int offset)
+{
+    return (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+}
+
+static int constant_long_instruction(VM *vm, const char *name, Chunk *chunk, int offset)
+{
+    int constant = long_operand(chunk, offset);
+    printf("%-16s %4d '", name, constant);
+    value_print(vm, chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
+static int global_long_instruction(VM *vm, const char *name, Chunk *chunk, int offset)
+{
+    int slot = long_operand(chunk, offset);
+    ObjString *global = vm_global_name(vm, slot);
+    printf("%-16s %4d '%s'\n", name, slot, global != NULL ? global->chars : "?");
+    return offset + 4;
+}
+
 static int simple_instruction(const char *name, int offset)
 {
     printf("%s\n", name);
     return offset + 1;
 }
 
-void chunk_disassemble(Chunk *chunk, const char *name)
+void chunk_disassemble(VM *vm, Chunk *chunk, const char *name)
 {
     printf("==   %s   ==\n", name);
 
     for (int offset = 0; offset < chunk->count;)
     {
-        offset = disassemble_instruction(chunk, offset);
+        offset = disassemble_instruction(vm, chunk, offset);
     }
 
     printf("== %s end ==\n", name);
 }
 
-int disassemble_instruction(Chunk *chunk, int offset)
+int disassemble_instruction(VM *vm, Chunk *chunk, int offset)
 {
     printf("%04d ", offset);
 
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+    int line = chunk_get_line(chunk, offset);
+
+    if (offset > 0 && line == chunk_get_line(chunk, offset - 1))
     {
         printf("   | ");
     }
     else
     {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
+    const char *name = opcode_name(instruction);
 
     switch (instruction)
     {
     case OP_CONSTANT:
-        return constant_instruction("OP_CONSTANT", chunk, offset);
+    case OP_ADD_CONSTANT:
+    case OP_SUBTRACT_CONSTANT:
+    case OP_MULTIPLY_CONSTANT:
+    case OP_DIVIDE_CONSTANT:
+        return constant_instruction(vm, name, chunk, offset);
+    case OP_CONSTANT_LONG:
+        return constant_long_instruction(vm, name, chunk, offset);
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+        return global_instruction(vm, name, chunk, offset);
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+        return global_long_instruction(vm, name, chunk, offset);
+    case OP_CONCAT_N:
+        return byte_instruction(name, chunk, offset);
     case OP_NONE:
-        return simple_instruction("OP_NONE", offset);
     case OP_TRUE:
-        return simple_instruction("OP_TRUE", offset);
     case OP_FALSE:
-        return simple_instruction("OP_FALSE", offset);
     case OP_POP:
-        return simple_instruction("OP_POP", offset);
-    case OP_GET_GLOBAL:
-        return constant_instruction("OP_GET_GLOBAL", chunk, offset);
-    case OP_DEFINE_GLOBAL:
-        return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_EQUAL:
-        return simple_instruction("OP_EQUAL", offset);
     case OP_GREATER:
-        return simple_instruction("OP_GREATER", offset);
     case OP_LESS:
-        return simple_instruction("OP_LESS", offset);
     case OP_ADD:
-        return simple_instruction("OP_ADD", offset);
     case OP_SUBTRACT:
-        return simple_instruction("OP_SUBTRACT", offset);
     case OP_MULTIPLY:
-        return simple_instruction("OP_MULTIPLY", offset);
     case OP_DIVIDE:
-        return simple_instruction("OP_DIVIDE", offset);
     case OP_NOT:
-        return simple_instruction("OP_NOT", offset);
     case OP_NEGATE:
-        return simple_instruction("OP_NEGATE", offset);
     case OP_PRINT:
-        return simple_instruction("OP_PRINT", offset);
     case OP_RETURN:
-        return simple_instruction("OP_RETURN", offset);
+    case OP_NOT_EQUAL:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_EQUAL_NUM:
+    case OP_NOT_EQUAL_NUM:
+        return simple_instruction(name, offset);
     default:
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
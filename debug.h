@@ -3,7 +3,8 @@
 
 #include "chunk.h"
 
-void chunk_disassemble(Chunk *chunk, const char *name);
-int disassemble_instruction(Chunk *chunk, int offset);
+const char *opcode_name(uint8_t instruction);
+void chunk_disassemble(VM *vm, Chunk *chunk, const char *name);
+int disassemble_instruction(VM *vm, Chunk *chunk, int offset);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,63 @@
+// A minimal program embedding the VM through libvm.h. CI builds it against
+// libvm.a and runs it, so it exits non-zero if the public API misbehaves.
+//
+//     make lib
+//     cc -I. examples/host.c build/lib/libvm.a -lm -o host && ./host
+
+#include <stdio.h>
+
+#include "libvm.h"
+
+static void on_print(VmValue value, void *user_data)
+{
+    double *total = (double *)user_data;
+
+    if (value.type == VM_NUMBER)
+    {
+        *total += value.as.number;
+    }
+}
+
+int main(void)
+{
+    VM *vm = vm_new();
+
+    if (vm == NULL)
+        return 1;
+
+    double printed = 0;
+    vm_set_print_handler(vm, on_print, &printed);
+
+    VmValue scale = {VM_NUMBER, {.number = 2}};
+
+    if (!vm_set_global_named(vm, "scale", scale))
+        return 1;
+
+    int x = vm_resolve_global(vm, "x");
+    VmScript *script = vm_compile(vm, "var y = x * scale; print y;");
+
+    if (script == NULL)
+        return 1;
+
+    for (int i = 1; i <= 3; i++)
+    {
+        VmValue value = {VM_NUMBER, {.number = i}};
+
+        if (!vm_set_global(vm, x, value) || vm_run(vm, script) != INTERPRET_OK)
+            return 1;
+    }
+
+    VmValue y;
+
+    if (!vm_get_global_named(vm, "y", &y) || y.type != VM_NUMBER || y.as.number != 6 || printed != 12)
+    {
+        fprintf(stderr, "unexpected results\n");
+        return 1;
+    }
+
+    vm_script_free(vm, script);
+    vm_delete(vm);
+
+    printf("ok\n");
+    return 0;
+}
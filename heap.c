@@ -0,0 +1,311 @@
+#include <string.h>
+
+#include "heap.h"
+#include "memory.h"
+#include "vm.h"
+
+#define PAGE_HEADER_SIZE ((sizeof(Page) + HEAP_MIN_CELL - 1) & ~(size_t)(HEAP_MIN_CELL - 1))
+#define PAGE_CELLS(page) ((char *)(page) + PAGE_HEADER_SIZE)
+#define PAGE_OF(object) ((Page *)((uintptr_t)(object) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1)))
+
+static const int size_classes[HEAP_SIZE_CLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048};
+
+static int size_class(size_t size)
+{
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++)
+    {
+        if (size <= (size_t)size_classes[i])
+            return i;
+    }
+
+    return -1;
+}
+
+static int cell_index(Page *page, Obj *object)
+{
+    return (int)(((char *)object - PAGE_CELLS(page)) / page->cell_size);
+}
+
+static Page *first_page(HeapBlock *block)
+{
+    uintptr_t start = (uintptr_t)(block + 1);
+    return (Page *)((start + HEAP_PAGE_SIZE - 1) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+}
+
+// Allocates a block with room for size bytes of aligned pages.
+static HeapBlock *new_block(Heap *heap, size_t size)
+{
+    size_t total = sizeof(HeapBlock) + HEAP_PAGE_SIZE + size;
+    HeapBlock *block = (HeapBlock *)raw_reallocate(heap->vm, MEMORY_HEAP_FREE, NULL, 0, total);
+
+    if (block == NULL)
+    {
+        collect_garbage(heap->vm);
+        block = (HeapBlock *)raw_reallocate(heap->vm, MEMORY_HEAP_FREE, NULL, 0, total);
+
+        if (block == NULL)
+            out_of_memory(heap->vm);
+    }
+
+    block->next = NULL;
+    block->size = total;
+    return block;
+}
+
+static void add_spare_pages(Heap *heap)
+{
+    int pages = heap->block_pages;
+    HeapBlock *block = new_block(heap, (size_t)pages * HEAP_PAGE_SIZE);
+    block->next = heap->blocks;
+    heap->blocks = block;
+
+    if (heap->block_pages < HEAP_BLOCK_PAGES)
+    {
+        heap->block_pages *= 2;
+    }
+
+    char *start = (char *)first_page(block);
+
+    for (int i = pages - 1; i >= 0; i--)
+    {
+        Page *page = (Page *)(start + (size_t)i * HEAP_PAGE_SIZE);
+        page->next = heap->spare;
+        heap->spare = page;
+    }
+}
+
+static Page *new_page(Heap *heap, size_t size, int cell_size, int cell_count)
+{
+    Page *page;
+    HeapBlock *block = NULL;
+
+    if (size == HEAP_PAGE_SIZE)
+    {
+        if (heap->spare == NULL)
+            add_spare_pages(heap);
+
+        page = heap->spare;
+        heap->spare = page->next;
+    }
+    else
+    {
+        block = new_block(heap, size);
+        page = first_page(block);
+    }
+
+    memset(page, 0, PAGE_HEADER_SIZE);
+    page->block = block;
+    page->size = size;
+    page->cell_size = cell_size;
+    page->cell_count = cell_count;
+
+    heap->vm->bytes_allocated += size;
+    return page;
+}
+
+static void free_page(Heap *heap, Page *page)
+{
+    heap->vm->bytes_allocated -= page->size;
+
+    if (page->block != NULL)
+    {
+        raw_reallocate(heap->vm, MEMORY_HEAP_FREE, page->block, page->block->size, 0);
+    }
+    else
+    {
+        page->next = heap->spare;
+        heap->spare = page;
+    }
+}
+
+static Obj *take_cell(Page *page)
+{
+    char *cell;
+
+    if (page->free_list != NULL)
+    {
+        cell = (char *)page->free_list;
+        page->free_list = *(void **)cell;
+    }
+    else if (page->bump < page->cell_count)
+    {
+        cell = PAGE_CELLS(page) + (size_t)page->bump * page->cell_size;
+        page->bump++;
+    }
+    else
+    {
+        return NULL;
+    }
+
+    int index = cell_index(page, (Obj *)cell);
+    page->allocated[index / 64] |= (uint64_t)1 << (index % 64);
+    page->live_count++;
+    return (Obj *)cell;
+}
+
+static Obj *allocate_small(Heap *heap, int class)
+{
+    for (Page *page = heap->current[class]; page != NULL; page = page->next)
+    {
+        Obj *object = take_cell(page);
+        if (object != NULL)
+        {
+            heap->current[class] = page;
+            return object;
+        }
+    }
+
+    return NULL;
+}
+
+void heap_init(Heap *heap, VM *vm)
+{
+    heap->vm = vm;
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++)
+    {
+        heap->pages[i] = NULL;
+        heap->current[i] = NULL;
+    }
+    heap->large = NULL;
+    heap->spare = NULL;
+    heap->blocks = NULL;
+    heap->block_pages = 1;
+}
+
+Obj *heap_allocate(Heap *heap, size_t size)
+{
+#ifdef DEBUG_STRESS_GC
+    collect_garbage(heap->vm);
+#endif
+
+    int class = size_class(size);
+
+    if (class == -1)
+    {
+        if (heap->vm->bytes_allocated + size > heap->vm->next_gc)
+            collect_garbage(heap->vm);
+
+        size_t page_size = (PAGE_HEADER_SIZE + size + HEAP_PAGE_SIZE - 1) & ~(size_t)(HEAP_PAGE_SIZE - 1);
+        Page *page = new_page(heap, page_size, (int)size, 1);
+        page->next = heap->large;
+        heap->large = page;
+        return take_cell(page);
+    }
+
+    Obj *object = allocate_small(heap, class);
+    if (object != NULL)
+        return object;
+
+    // Out of cells in this class: collect first if the heap has grown
+    // enough, and only add a page if that didn't free any.
+    if (heap->vm->bytes_allocated + HEAP_PAGE_SIZE > heap->vm->next_gc)
+    {
+        collect_garbage(heap->vm);
+
+        object = allocate_small(heap, class);
+        if (object != NULL)
+            return object;
+    }
+
+    int cell_size = size_classes[class];
+    Page *page = new_page(heap, HEAP_PAGE_SIZE, cell_size, (int)((HEAP_PAGE_SIZE - PAGE_HEADER_SIZE) / cell_size));
+    page->next = heap->pages[class];
+    heap->pages[class] = page;
+    heap->current[class] = page;
+    return take_cell(page);
+}
+
+bool heap_mark(Obj *object)
+{
+    Page *page = PAGE_OF(object);
+    int index = cell_index(page, object);
+    uint64_t bit = (uint64_t)1 << (index % 64);
+
+    if (page->marks[index / 64] & bit)
+        return false;
+
+    page->marks[index / 64] |= bit;
+    return true;
+}
+
+bool heap_is_marked(Obj *object)
+{
+    Page *page = PAGE_OF(object);
+    int index = cell_index(page, object);
+    return (page->marks[index / 64] >> (index % 64)) & 1;
+}
+
+// Releases every allocated but unmarked cell in the page and clears the marks.
+static void sweep_page(Heap *heap, Page *page, ReleaseFn release)
+{
+    int words = (page->cell_count + 63) / 64;
+
+    for (int word = 0; word < words; word++)
+    {
+        uint64_t dead = page->allocated[word] & ~page->marks[word];
+
+        while (dead != 0)
+        {
+            int index = word * 64 + __builtin_ctzll(dead);
+            dead &= dead - 1;
+
+            char *cell = PAGE_CELLS(page) + (size_t)index * page->cell_size;
+            release(heap->vm, (Obj *)cell);
+
+            *(void **)cell = page->free_list;
+            page->free_list = cell;
+            page->live_count--;
+        }
+
+        page->allocated[word] &= page->marks[word];
+        page->marks[word] = 0;
+    }
+}
+
+static void sweep_list(Heap *heap, Page **list, ReleaseFn release)
+{
+    Page **link = list;
+
+    while (*link != NULL)
+    {
+        Page *page = *link;
+        sweep_page(heap, page, release);
+
+        if (page->live_count == 0)
+        {
+            *link = page->next;
+            free_page(heap, page);
+        }
+        else
+        {
+            link = &page->next;
+        }
+    }
+}
+
+void heap_sweep(Heap *heap, ReleaseFn release)
+{
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++)
+    {
+        sweep_list(heap, &heap->pages[i], release);
+        heap->current[i] = heap->pages[i];
+    }
+
+    sweep_list(heap, &heap->large, release);
+}
+
+void heap_free(Heap *heap, ReleaseFn release)
+{
+    // With nothing marked a sweep releases every object and page.
+    heap_sweep(heap, release);
+
+    while (heap->blocks != NULL)
+    {
+        HeapBlock *next = heap->blocks->next;
+        raw_reallocate(heap->vm, MEMORY_HEAP_FREE, heap->blocks, heap->blocks->size, 0);
+        heap->blocks = next;
+    }
+
+    heap->spare = NULL;
+}
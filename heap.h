@@ -0,0 +1,67 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include "common.h"
+#include "value.h"
+
+// Pages are aligned to their size so the page holding an object, and with it
+// the object's mark bit, is found by masking the object's address.
+#define HEAP_PAGE_SIZE (64 * 1024)
+#define HEAP_MIN_CELL 16
+#define HEAP_MAX_CELL 2048
+#define HEAP_SIZE_CLASSES 14
+#define HEAP_BITMAP_WORDS (HEAP_PAGE_SIZE / HEAP_MIN_CELL / 64)
+// Ordinary pages are carved out of blocks that start with room for one page
+// and double up to this many, so a small heap stays small while aligning a
+// grown heap's blocks wastes at most one page in HEAP_BLOCK_PAGES.
+#define HEAP_BLOCK_PAGES 8
+
+// Memory obtained from the VM's allocator, which knows nothing about
+// alignment. The pages start at the first aligned address after the header.
+typedef struct HeapBlock
+{
+    struct HeapBlock *next;
+    size_t size;
+} HeapBlock;
+
+typedef struct Page
+{
+    struct Page *next;
+    size_t size;
+    int cell_size;
+    int cell_count;
+    int bump;
+    int live_count;
+    void *free_list;
+    // The block a large page was allocated in on its own, or NULL for a page
+    // carved from one of the heap's blocks.
+    HeapBlock *block;
+    uint64_t allocated[HEAP_BITMAP_WORDS];
+    uint64_t marks[HEAP_BITMAP_WORDS];
+} Page;
+
+typedef struct
+{
+    Page *pages[HEAP_SIZE_CLASSES];
+    Page *current[HEAP_SIZE_CLASSES];
+    // Objects bigger than HEAP_MAX_CELL each get a page of their own.
+    Page *large;
+    // Ordinary pages no size class is using, and the blocks they came from.
+    Page *spare;
+    HeapBlock *blocks;
+    // How many pages the next block will hold.
+    int block_pages;
+    // The VM the heap belongs to, which accounts for its pages.
+    VM *vm;
+} Heap;
+
+typedef void (*ReleaseFn)(VM *vm, Obj *object);
+
+void heap_init(Heap *heap, VM *vm);
+void heap_free(Heap *heap, ReleaseFn release);
+Obj *heap_allocate(Heap *heap, size_t size);
+bool heap_mark(Obj *object);
+bool heap_is_marked(Obj *object);
+void heap_sweep(Heap *heap, ReleaseFn release);
+
+#endif
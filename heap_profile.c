@@ -0,0 +1,159 @@
+#include <stdlib.h>
+
+#include "compiler.h"
+#include "heap_profile.h"
+#include "vm.h"
+
+void heap_profile_init(HeapProfile *profile, size_t rate)
+{
+    profile->rate = rate;
+    profile->countdown = rate;
+    profile->samples = 0;
+    profile->count = 0;
+    profile->capacity = 0;
+    profile->sites = NULL;
+}
+
+// The profile belongs to the host rather than the VM, so it uses the system
+// allocator and isn't counted in the VM's memory.
+void heap_profile_free(HeapProfile *profile)
+{
+    free(profile->sites);
+    heap_profile_init(profile, profile->rate);
+}
+
+static const char *phase_names[] = {
+    [HEAP_PHASE_RUN] = "run",
+    [HEAP_PHASE_COMPILE] = "compile",
+    [HEAP_PHASE_CACHE] = "cache",
+};
+
+static HeapSite *find_site(HeapProfile *profile, int line, HeapPhase phase, const char *kind)
+{
+    // Samples are rare enough, and sites few enough, for a scan.
+    for (int i = 0; i < profile->count; i++)
+    {
+        HeapSite *site = &profile->sites[i];
+
+        if (site->line == line && site->phase == phase && site->kind == kind)
+            return site;
+    }
+
+    if (profile->count == profile->capacity)
+    {
+        int capacity = profile->capacity < 8 ? 8 : profile->capacity * 2;
+        HeapSite *sites = (HeapSite *)realloc(profile->sites, sizeof(HeapSite) * capacity);
+
+        if (sites == NULL)
+            return NULL;
+
+        profile->sites = sites;
+        profile->capacity = capacity;
+    }
+
+    HeapSite *site = &profile->sites[profile->count++];
+    site->line = line;
+    site->phase = phase;
+    site->kind = kind;
+    site->samples = 0;
+    site->bytes = 0;
+    return site;
+}
+
+void heap_profile_record(VM *vm, const char *kind, size_t size)
+{
+    HeapProfile *profile = vm->heap_profile;
+
+    if (size < profile->countdown)
+    {
+        profile->countdown -= size;
+        return;
+    }
+
+    // A big allocation can cross several sampling points at once.
+    size -= profile->countdown;
+    size_t samples = 1 + size / profile->rate;
+    profile->countdown = profile->rate - size % profile->rate;
+
+    int line = 0;
+    HeapPhase phase = HEAP_PHASE_RUN;
+
+    if (vm->chunk != NULL)
+    {
+        // ip is past the instruction being run. The cache sets chunk to load
+        // or write it without running it, leaving ip NULL.
+        Chunk *chunk = vm->chunk;
+
+        if (vm->ip != NULL && vm->ip > chunk->code && vm->ip <= chunk->code + chunk->count)
+        {
+            line = chunk_get_line(chunk, (int)(vm->ip - chunk->code - 1));
+        }
+        else
+        {
+            phase = HEAP_PHASE_CACHE;
+        }
+    }
+    else if (vm->compiler != NULL)
+    {
+        line = vm->compiler->parser.previous.line;
+        phase = HEAP_PHASE_COMPILE;
+    }
+
+    HeapSite *site = find_site(profile, line, phase, kind);
+
+    if (site != NULL)
+    {
+        site->samples += samples;
+        site->bytes += samples * profile->rate;
+        profile->samples += samples;
+    }
+}
+
+static int compare_sites(const void *a, const void *b)
+{
+    const HeapSite *left = (const HeapSite *)a;
+    const HeapSite *right = (const HeapSite *)b;
+
+    if (left->bytes != right->bytes)
+        return left->bytes < right->bytes ? 1 : -1;
+
+    return left->line - right->line;
+}
+
+void heap_profile_report(HeapProfile *profile, FILE *file)
+{
+    qsort(profile->sites, profile->count, sizeof(HeapSite), compare_sites);
+
+    size_t total = profile->samples * profile->rate;
+    fprintf(file, "Heap profile: %zu samples, one every %zu bytes, ~%zu bytes allocated\n", profile->samples,
+            profile->rate, total);
+
+    if (total == 0)
+        return;
+
+    fprintf(file, "%12s %6s %8s  %s\n", "bytes", "%", "samples", "site");
+
+    for (int i = 0; i < profile->count; i++)
+    {
+        HeapSite *site = &profile->sites[i];
+        fprintf(file, "%12zu %5.1f%% %8zu  %s line %d %s\n", site->bytes, 100.0 * site->bytes / total, site->samples,
+                phase_names[site->phase], site->line, site->kind);
+    }
+}
+
+bool heap_profile_write_collapsed(HeapProfile *profile, const char *script, const char *path)
+{
+    FILE *file = fopen(path, "w");
+
+    if (file == NULL)
+        return false;
+
+    for (int i = 0; i < profile->count; i++)
+    {
+        HeapSite *site = &profile->sites[i];
+        fprintf(file, "%s;%s;line %d;%s %zu\n", script, phase_names[site->phase], site->line, site->kind,
+                site->bytes);
+    }
+
+    return fclose(file) == 0;
+}
@@ -0,0 +1,54 @@
+#ifndef HEAP_PROFILE_H
+#define HEAP_PROFILE_H
+
+#include <stdio.h>
+
+#include "common.h"
+
+#define HEAP_PROFILE_RATE (64 * 1024)
+
+// What the VM was doing when a sample was taken. Loading or writing the
+// cache has no source line, so those samples are all on line 0.
+typedef enum
+{
+    HEAP_PHASE_RUN,
+    HEAP_PHASE_COMPILE,
+    HEAP_PHASE_CACHE
+} HeapPhase;
+
+// Allocations are sampled once every rate bytes, and each sample is charged
+// the full rate bytes, so a site's bytes estimate what it allocated in
+// total. Sites are the phase and source line the sample was taken in and
+// the kind of memory allocated.
+typedef struct
+{
+    int line;
+    HeapPhase phase;
+    // An object type or memory category name, compared by address.
+    const char *kind;
+    size_t samples;
+    size_t bytes;
+} HeapSite;
+
+typedef struct HeapProfile
+{
+    size_t rate;
+    // Bytes left to allocate before the next sample.
+    size_t countdown;
+    size_t samples;
+    int count;
+    int capacity;
+    HeapSite *sites;
+} HeapProfile;
+
+void heap_profile_init(HeapProfile *profile, size_t rate);
+void heap_profile_free(HeapProfile *profile);
+// Called for every allocation while vm->heap_profile is set.
+void heap_profile_record(VM *vm, const char *kind, size_t size);
+// Writes the sites sorted by bytes, biggest first.
+void heap_profile_report(HeapProfile *profile, FILE *file);
+// Writes the sites as collapsed stacks, script;phase;line;kind bytes, which
+// flamegraph.pl and most other flame graph tools read directly.
+bool heap_profile_write_collapsed(HeapProfile *profile, const char *script, const char *path);
+
+#endif
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "libvm.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+VmValue value_to_host(VM *vm, Value value)
+{
+    VmValue result;
+
+    if (IS_BOOL(value))
+    {
+        result.type = VM_BOOL;
+        result.as.boolean = AS_BOOL(value);
+    }
+    else if (IS_NUMBER(value))
+    {
+        result.type = VM_NUMBER;
+        result.as.number = AS_NUMBER(value);
+    }
+    else if (IS_STRING_LIKE(value))
+    {
+        ObjString *string = flatten(vm, AS_OBJ(value));
+        result.type = VM_STRING;
+        result.as.string.chars = string->chars;
+        result.as.string.length = string->length;
+    }
+    else
+    {
+        result.type = VM_NONE;
+    }
+
+    return result;
+}
+
+static Value value_from_host(VM *vm, VmValue value)
+{
+    switch (value.type)
+    {
+    case VM_BOOL:
+        return BOOL_VAL(value.as.boolean);
+    case VM_NUMBER:
+        return NUMBER_VAL(value.as.number);
+    case VM_STRING:
+        return OBJ_VAL(copy_string(vm, value.as.string.chars, value.as.string.length));
+    default:
+        return NONE_VAL;
+    }
+}
+
+VM *vm_new(void)
+{
+    return vm_new_with_allocator(NULL);
+}
+
+VM *vm_new_with_allocator(const VmAllocator *allocator)
+{
+    VM *vm = allocator != NULL ? (VM *)allocator->realloc(NULL, 0, sizeof(VM), allocator->user_data)
+                               : (VM *)malloc(sizeof(VM));
+
+    if (vm != NULL && !vm_init(vm, allocator))
+    {
+        vm_delete(vm);
+        return NULL;
+    }
+
+    return vm;
+}
+
+void vm_delete(VM *vm)
+{
+    // The VM itself lives in its allocator's memory, so keep a copy.
+    VmAllocator allocator = vm->allocator;
+
+    if (allocator.reset != NULL)
+    {
+        allocator.reset(allocator.user_data);
+        return;
+    }
+
+    vm_free(vm);
+    allocator.realloc(vm, sizeof(VM), 0, allocator.user_data);
+}
+
+// The host API is entered without a compile or run in progress to catch
+// running out of memory, so calls that allocate set their own recovery
+// point, restoring the outer one before returning.
+VmScript *vm_compile(VM *vm, const char *source)
+{
+    // Bypasses reallocate() so it can fail by returning NULL.
+    VmScript *script = (VmScript *)raw_reallocate(vm, MEMORY_OTHER, NULL, 0, sizeof(VmScript));
+
+    if (script == NULL)
+    {
+        fprintf(stderr, "%s\n", memory_error(vm));
+        return NULL;
+    }
+
+    chunk_init(&script->chunk);
+
+    if (!compile(vm, source, &script->chunk))
+    {
+        chunk_free(vm, &script->chunk);
+        raw_reallocate(vm, MEMORY_OTHER, script, sizeof(VmScript), 0);
+        return NULL;
+    }
+
+    script->next = vm->scripts;
+    vm->scripts = script;
+    return script;
+}
+
+InterpretResult vm_run(VM *vm, VmScript *script)
+{
+    return interpret_chunk(vm, &script->chunk);
+}
+
+void vm_script_free(VM *vm, VmScript *script)
+{
+    for (VmScript **link = &vm->scripts; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == script)
+        {
+            *link = script->next;
+            break;
+        }
+    }
+
+    chunk_free(vm, &script->chunk);
+    raw_reallocate(vm, MEMORY_OTHER, script, sizeof(VmScript), 0);
+}
+
+int vm_resolve_global(VM *vm, const char *name)
+{
+    jmp_buf recover;
+    jmp_buf *outer = vm->out_of_memory;
+    int slot = -1;
+
+    vm->out_of_memory = &recover;
+
+    if (setjmp(recover) == 0)
+    {
+        slot = vm_global_slot(vm, copy_string(vm, name, (int)strlen(name)));
+    }
+
+    vm->out_of_memory = outer;
+    return slot;
+}
+
+bool vm_get_global(VM *vm, int slot, VmValue *value)
+{
+    if (slot < 0 || slot >= vm->global_values.count || IS_UNDEFINED(vm->global_values.values[slot]))
+    {
+        return false;
+    }
+
+    jmp_buf recover;
+    jmp_buf *outer = vm->out_of_memory;
+    bool converted = false;
+
+    vm->out_of_memory = &recover;
+
+    // Flattening a rope allocates.
+    if (setjmp(recover) == 0)
+    {
+        *value = value_to_host(vm, vm->global_values.values[slot]);
+        converted = true;
+    }
+
+    vm->out_of_memory = outer;
+    return converted;
+}
+
+bool vm_set_global(VM *vm, int slot, VmValue value)
+{
+    if (slot < 0 || slot >= vm->global_values.count)
+    {
+        return false;
+    }
+
+    jmp_buf recover;
+    jmp_buf *outer = vm->out_of_memory;
+    bool set = false;
+
+    vm->out_of_memory = &recover;
+
+    if (setjmp(recover) == 0)
+    {
+        vm->global_values.values[slot] = value_from_host(vm, value);
+        set = true;
+    }
+
+    vm->out_of_memory = outer;
+    return set;
+}
+
+bool vm_get_global_named(VM *vm, const char *name, VmValue *value)
+{
+    return vm_get_global(vm, vm_resolve_global(vm, name), value);
+}
+
+bool vm_set_global_named(VM *vm, const char *name, VmValue value)
+{
+    return vm_set_global(vm, vm_resolve_global(vm, name), value);
+}
+
+void vm_set_print_handler(VM *vm, VmPrintFn print, void *user_data)
+{
+    vm->print = print;
+    vm->print_data = user_data;
+}
+
+size_t vm_memory_used(VM *vm)
+{
+    return vm->memory.total;
+}
+
+size_t vm_memory_peak(VM *vm)
+{
+    return vm->memory.peak;
+}
+
+void vm_set_memory_limit(VM *vm, size_t limit)
+{
+    vm->memory.limit = limit;
+}
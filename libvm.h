@@ -0,0 +1,110 @@
+#ifndef LIBVM_H
+#define LIBVM_H
+
+// Public interface for embedding the VM in another program. Link against
+// libvm.a or libvm.so (`make lib`) and include only this header.
+//
+// A VM is single-threaded, but separate VMs share nothing, so a host can run
+// one per thread. Scripts are compiled once and can then be run any number
+// of times on the VM that compiled them, sharing its globals.
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// libvm.so is built with hidden visibility, exporting only these functions
+// so the interpreter's internals can't clash with the host's symbols.
+#if defined(__GNUC__)
+#define VM_API __attribute__((visibility("default")))
+#else
+#define VM_API
+#endif
+
+typedef struct VM VM;
+typedef struct VmScript VmScript;
+
+typedef enum
+{
+    INTERPRET_OK,
+    INTERPRET_COMPILE_ERROR,
+    INTERPRET_RUNTIME_ERROR,
+} InterpretResult;
+
+typedef enum
+{
+    VM_NONE,
+    VM_BOOL,
+    VM_NUMBER,
+    VM_STRING,
+} VmValueType;
+
+// A value as seen by the host. Strings handed out by the VM point into its
+// heap and stay valid only until the VM next runs or compiles anything;
+// strings passed in are copied.
+typedef struct
+{
+    VmValueType type;
+    union
+    {
+        bool boolean;
+        double number;
+        struct
+        {
+            const char *chars;
+            int length;
+        } string;
+    } as;
+} VmValue;
+
+// Every allocation a VM makes goes through its allocator, including the VM
+// itself. realloc behaves like realloc(3) except that it is also told the
+// old size: ptr is NULL for a new block and new_size is 0 to free one.
+// Returning NULL for a non-zero size means out of memory, which fails the
+// compile or run in progress rather than the process.
+//
+// reset is optional. When set, vm_delete() calls it instead of freeing the
+// VM's memory piece by piece, so an arena can drop everything at once.
+typedef void *(*VmReallocFn)(void *ptr, size_t old_size, size_t new_size, void *user_data);
+typedef void (*VmResetFn)(void *user_data);
+
+typedef struct
+{
+    VmReallocFn realloc;
+    VmResetFn reset;
+    void *user_data;
+} VmAllocator;
+
+// Called with each value a script prints, in place of writing it to stdout.
+typedef void (*VmPrintFn)(VmValue value, void *user_data);
+
+// Both return NULL if the VM itself can't be allocated.
+VM_API VM *vm_new(void);
+VM_API VM *vm_new_with_allocator(const VmAllocator *allocator);
+VM_API void vm_delete(VM *vm);
+
+// Returns NULL and reports errors on stderr if the source doesn't compile.
+VM_API VmScript *vm_compile(VM *vm, const char *source);
+VM_API InterpretResult vm_run(VM *vm, VmScript *script);
+VM_API void vm_script_free(VM *vm, VmScript *script);
+
+// Globals are numbered by slot. Resolving a name gives its slot, reserving
+// one if no script has used the name yet, so hosts can look a name up once
+// and then use the slot. Getting a global that was never set, or using a slot
+// that was never resolved, fails. So does running out of memory, with
+// resolving returning -1.
+VM_API int vm_resolve_global(VM *vm, const char *name);
+VM_API bool vm_get_global(VM *vm, int slot, VmValue *value);
+VM_API bool vm_set_global(VM *vm, int slot, VmValue value);
+VM_API bool vm_get_global_named(VM *vm, const char *name, VmValue *value);
+VM_API bool vm_set_global_named(VM *vm, const char *name, VmValue value);
+
+VM_API void vm_set_print_handler(VM *vm, VmPrintFn print, void *user_data);
+
+// Bytes the VM has allocated, not counting the VM itself, now and at most.
+// Allocating past a non-zero limit fails the compile or run in progress with
+// "Memory limit exceeded." Setting a limit below what is already in use only
+// stops further growth.
+VM_API size_t vm_memory_used(VM *vm);
+VM_API size_t vm_memory_peak(VM *vm);
+VM_API void vm_set_memory_limit(VM *vm, size_t limit);
+
+#endif
@@ -2,11 +2,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include "common.h"
+#include "cache.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "heap_profile.h"
+#include "profile.h"
+#include "verify.h"
 #include "vm.h"
 
-static void repl()
+static void repl(VM *vm)
 {
     char line[1024];
     for (;;)
@@ -17,7 +22,7 @@ static void repl()
             printf("\n");
             break;
         }
-        interpret(line);
+        interpret(vm, line);
     }
 }
 
@@ -57,42 +62,172 @@ static char *read_file(const char *path)
     return buffer;
 }
 
-static void run_file(const char *path)
+// Returns the process's exit status.
+static int run_file(VM *vm, const char *path)
 {
     char *source = read_file(path);
+    uint64_t key = cache_key(source);
+    Chunk chunk;
+    chunk_init(&chunk);
+
+    // A cached chunk skips the scanner and compiler entirely. Otherwise the
+    // fresh one is cached before running, since running quickens its code.
+    if (!cache_load(vm, path, key, &chunk))
+    {
+        if (!compile(vm, source, &chunk))
+        {
+            chunk_free(vm, &chunk);
+            free(source);
+            return 65;
+        }
+
+        // Only code that will run is worth caching.
+        if (verify_chunk(vm, &chunk, NULL))
+        {
+            cache_write(vm, path, key, &chunk);
+        }
+    }
 
-    InterpretResult result = interpret(source);
     free(source);
 
+    InterpretResult result = interpret_chunk(vm, &chunk);
+    chunk_free(vm, &chunk);
+
     if (result == INTERPRET_COMPILE_ERROR)
     {
-        exit(65);
+        return 65;
     }
     if (result == INTERPRET_RUNTIME_ERROR)
     {
-        exit(70);
+        return 70;
     }
+
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: vm [--mem-stats] [--mem-limit bytes] [--heap-profile file] [--heap-sample bytes]\n"
+                    "          [--profile] [--profile-time] [path]\n");
+    exit(64);
 }
 
 int main(int argc, char *argv[])
 {
-    vm_init();
+    bool mem_stats = false;
+    size_t mem_limit = 0;
+    const char *heap_profile_path = NULL;
+    size_t heap_sample = HEAP_PROFILE_RATE;
+    bool profile_run = false;
+    bool profile_time = false;
+    int arg = 1;
+
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++)
+    {
+        if (strcmp(argv[arg], "--mem-stats") == 0)
+        {
+            mem_stats = true;
+        }
+        else if (strcmp(argv[arg], "--mem-limit") == 0 && arg + 1 < argc)
+        {
+            char *end;
+            mem_limit = strtoull(argv[++arg], &end, 10);
 
-    if (argc == 1)
+            if (*end != '\0' || mem_limit == 0)
+                usage();
+        }
+        else if (strcmp(argv[arg], "--profile") == 0)
+        {
+            profile_run = true;
+        }
+        else if (strcmp(argv[arg], "--profile-time") == 0)
+        {
+            profile_run = true;
+            profile_time = true;
+        }
+        else if (strcmp(argv[arg], "--heap-profile") == 0 && arg + 1 < argc)
+        {
+            heap_profile_path = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "--heap-sample") == 0 && arg + 1 < argc)
+        {
+            char *end;
+            heap_sample = strtoull(argv[++arg], &end, 10);
+
+            if (*end != '\0' || heap_sample == 0)
+                usage();
+        }
+        else
+        {
+            usage();
+        }
+    }
+
+    if (argc - arg > 1)
+        usage();
+
+    VM vm;
+
+    if (!vm_init(&vm, NULL))
     {
-        repl();
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
     }
-    else if (argc == 2)
+
+    vm.memory.limit = mem_limit;
+    int status = 0;
+
+    // Sampling is only ever done for a profile someone asked for.
+    HeapProfile heap_profile;
+    heap_profile_init(&heap_profile, heap_sample);
+
+    if (heap_profile_path != NULL)
     {
-        run_file(argv[1]);
+        vm.heap_profile = &heap_profile;
+    }
+
+    Profile profile;
+    profile_init(&profile, profile_time);
+
+    if (profile_run)
+    {
+        vm.profile = &profile;
+    }
+
+    if (arg == argc)
+    {
+        repl(&vm);
     }
     else
     {
-        fprintf(stderr, "Usage: vm [path]\n");
-        exit(64);
+        status = run_file(&vm, argv[arg]);
     }
 
-    vm_free();
+    if (mem_stats)
+    {
+        memory_print_stats(&vm);
+    }
 
-    return 0;
+    if (heap_profile_path != NULL)
+    {
+        heap_profile_report(&heap_profile, stderr);
+
+        if (!heap_profile_write_collapsed(&heap_profile, arg < argc ? argv[arg] : "repl", heap_profile_path))
+        {
+            fprintf(stderr, "Could not write heap profile \"%s\".\n", heap_profile_path);
+        }
+    }
+
+    heap_profile_free(&heap_profile);
+
+    if (profile_run)
+    {
+        profile_report(&profile, stderr);
+    }
+
+    profile_free(&profile);
+
+    vm_free(&vm);
+
+    return status;
 }
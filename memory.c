@@ -1,46 +1,317 @@
 #include "memory.h"
+#include <setjmp.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include "compiler.h"
+#include "heap.h"
+#include "heap_profile.h"
 #include "object.h"
+#include "table.h"
 #include "vm.h"
 
-void *reallocate(void *ptr, size_t old_size, size_t new_size)
+#define GC_HEAP_GROW_FACTOR 2
+
+static const char *category_names[MEMORY_CATEGORY_COUNT] = {
+    [MEMORY_CODE] = "code",
+    [MEMORY_LINES] = "line info",
+    [MEMORY_CONSTANTS] = "constants",
+    [MEMORY_STRINGS] = "strings",
+    [MEMORY_TABLES] = "tables",
+    [MEMORY_OBJECTS] = "objects",
+    [MEMORY_HEAP_FREE] = "heap free",
+    [MEMORY_STACK] = "stack",
+    [MEMORY_OTHER] = "other",
+};
+
+const char *memory_category_name(MemoryCategory category)
+{
+    return category_names[category];
+}
+
+void memory_stats_init(MemoryStats *stats)
+{
+    for (int i = 0; i < MEMORY_CATEGORY_COUNT; i++)
+    {
+        stats->bytes[i] = 0;
+    }
+
+    stats->total = 0;
+    stats->peak = 0;
+    stats->limit = 0;
+    stats->over_limit = false;
+}
+
+void memory_print_stats(VM *vm)
+{
+    MemoryStats *stats = &vm->memory;
+
+    fprintf(stderr, "Memory in use at exit:\n");
+
+    for (int i = 0; i < MEMORY_CATEGORY_COUNT; i++)
+    {
+        fprintf(stderr, "  %-10s %12zu\n", category_names[i], stats->bytes[i]);
+    }
+
+    fprintf(stderr, "  %-10s %12zu\n", "total", stats->total);
+    fprintf(stderr, "Peak %zu bytes", stats->peak);
+
+    if (stats->limit != 0)
+    {
+        fprintf(stderr, " of a %zu byte limit", stats->limit);
+    }
+
+    fprintf(stderr, "\n");
+}
+
+static void account(MemoryStats *stats, MemoryCategory category, size_t old_size, size_t new_size)
+{
+    // Unsigned wraparound makes this right for shrinking too.
+    stats->bytes[category] += new_size - old_size;
+    stats->total += new_size - old_size;
+
+    if (stats->total > stats->peak)
+    {
+        stats->peak = stats->total;
+    }
+}
+
+void memory_transfer(VM *vm, MemoryCategory from, MemoryCategory to, size_t size)
+{
+    vm->memory.bytes[from] -= size;
+    vm->memory.bytes[to] += size;
+}
+
+// Free space in the heap's pages doesn't count against the limit, only the
+// objects put in it, so the limit doesn't depend on how the heap grows.
+static bool over_limit(MemoryStats *stats, size_t growth)
+{
+    return stats->limit != 0 && stats->total - stats->bytes[MEMORY_HEAP_FREE] + growth > stats->limit;
+}
+
+void *raw_reallocate(VM *vm, MemoryCategory category, void *ptr, size_t old_size, size_t new_size)
 {
-    if (new_size == 0)
+    MemoryStats *stats = &vm->memory;
+
+    if (new_size > old_size)
     {
-        free(ptr);
-        return NULL;
+        stats->over_limit = category != MEMORY_HEAP_FREE && over_limit(stats, new_size - old_size);
+
+        if (stats->over_limit)
+            return NULL;
     }
 
-    void *result = realloc(ptr, new_size);
+    void *result = vm->allocator.realloc(ptr, old_size, new_size, vm->allocator.user_data);
+
+    if (result != NULL || new_size == 0)
+    {
+        account(stats, category, old_size, new_size);
+    }
+
+    return result;
+}
+
+void memory_check_limit(VM *vm, size_t size)
+{
+    if (!over_limit(&vm->memory, size))
+        return;
+
+    collect_garbage(vm);
+    vm->memory.over_limit = over_limit(&vm->memory, size);
+
+    if (vm->memory.over_limit)
+        out_of_memory(vm);
+}
+
+const char *memory_error(VM *vm)
+{
+    return vm->memory.over_limit ? "Memory limit exceeded." : "Out of memory.";
+}
 
-    if (result == NULL)
+void out_of_memory(VM *vm)
+{
+    if (vm->out_of_memory == NULL)
         exit(1);
 
+    longjmp(*vm->out_of_memory, 1);
+}
+
+void *reallocate(VM *vm, MemoryCategory category, void *ptr, size_t old_size, size_t new_size)
+{
+    vm->bytes_allocated += new_size - old_size;
+
+    if (new_size > old_size)
+    {
+        if (vm->heap_profile != NULL)
+        {
+            heap_profile_record(vm, memory_category_name(category), new_size - old_size);
+        }
+
+#ifdef DEBUG_STRESS_GC
+        collect_garbage(vm);
+#endif
+
+        if (vm->bytes_allocated > vm->next_gc)
+        {
+            collect_garbage(vm);
+        }
+    }
+
+    void *result = raw_reallocate(vm, category, ptr, old_size, new_size);
+
+    if (result == NULL && new_size > 0)
+    {
+        // Give back whatever garbage there is before giving up.
+        collect_garbage(vm);
+        result = raw_reallocate(vm, category, ptr, old_size, new_size);
+
+        if (result == NULL)
+        {
+            vm->bytes_allocated -= new_size - old_size;
+            out_of_memory(vm);
+        }
+    }
+
     return result;
 }
 
-static void free_object(Obj *object)
+void mark_object(VM *vm, Obj *object)
+{
+    if (object == NULL || !heap_mark(object))
+        return;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void *)object);
+    value_print(vm, OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    if (vm->gray_capacity < vm->gray_count + 1)
+    {
+        int capacity = GROW_CAPACITY(vm->gray_capacity);
+        size_t old_size = sizeof(Obj *) * vm->gray_capacity;
+        size_t new_size = sizeof(Obj *) * capacity;
+        // The gray stack goes straight to the allocator so growing it cannot
+        // recursively start a collection. A collection can't be abandoned
+        // halfway with some objects marked, so it may exceed the memory
+        // limit, and running out here is fatal.
+        vm->gray_stack = (Obj **)vm->allocator.realloc(vm->gray_stack, old_size, new_size, vm->allocator.user_data);
+
+        if (vm->gray_stack == NULL)
+            exit(1);
+
+        account(&vm->memory, MEMORY_OTHER, old_size, new_size);
+        vm->gray_capacity = capacity;
+    }
+
+    vm->gray_stack[vm->gray_count++] = object;
+}
+
+void mark_value(VM *vm, Value value)
+{
+    if (IS_OBJ(value))
+        mark_object(vm, AS_OBJ(value));
+}
+
+static void mark_array(VM *vm, ValueArray *array)
+{
+    for (int i = 0; i < array->count; i++)
+    {
+        mark_value(vm, array->values[i]);
+    }
+}
+
+static void blacken_object(VM *vm, Obj *object)
 {
+#ifdef DEBUG_LOG_GC
+    printf("%p blacken ", (void *)object);
+    value_print(vm, OBJ_VAL(object));
+    printf("\n");
+#endif
+
     switch (object->type)
     {
     case OBJ_STRING:
+        // Strings hold no references.
+        break;
+    case OBJ_ROPE:
     {
-        ObjString *string = (ObjString *)object;
-        FREE_ARRAY(char, string->chars, string->length + 1);
-        FREE(ObjString, object);
+        ObjRope *rope = (ObjRope *)object;
+        mark_object(vm, rope->left);
+        mark_object(vm, rope->right);
+        mark_object(vm, (Obj *)rope->flat);
         break;
     }
     }
 }
 
-void free_objects()
+// Releases what an object owns outside its heap cell. The cell itself is
+// reclaimed by the heap.
+static void free_object(VM *vm, Obj *object)
 {
-    Obj *object = vm.objects;
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void *)object, object->type);
+#endif
+
+    // Nothing is owned outside the cell, which goes back to the heap.
+    memory_transfer(vm, object_category(object->type), MEMORY_HEAP_FREE, object_size(object));
+}
+
+static void mark_roots(VM *vm)
+{
+    for (Value *slot = vm->stack; slot < vm->stack_top; slot++)
+    {
+        mark_value(vm, *slot);
+    }
+
+    mark_array(vm, &vm->global_values);
+    mark_table(vm, &vm->global_names);
 
-    while (object != NULL)
+    if (vm->chunk != NULL)
     {
-        Obj *next = object->next;
-        free_object(object);
-        object = next;
+        mark_array(vm, &vm->chunk->constants);
     }
+
+    for (VmScript *script = vm->scripts; script != NULL; script = script->next)
+    {
+        mark_array(vm, &script->chunk.constants);
+    }
+
+    mark_compiler_roots(vm);
+}
+
+static void trace_references(VM *vm)
+{
+    while (vm->gray_count > 0)
+    {
+        Obj *object = vm->gray_stack[--vm->gray_count];
+        blacken_object(vm, object);
+    }
+}
+
+void collect_garbage(VM *vm)
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+    size_t before = vm->bytes_allocated;
+#endif
+
+    mark_roots(vm);
+    trace_references(vm);
+    // Interned strings are weak: drop the ones nothing else reached.
+    table_remove_white(&vm->strings);
+    heap_sweep(&vm->heap, free_object);
+
+    vm->next_gc = vm->bytes_allocated * GC_HEAP_GROW_FACTOR;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+           before - vm->bytes_allocated, before, vm->bytes_allocated, vm->next_gc);
+#endif
+}
+
+void free_objects(VM *vm)
+{
+    heap_free(&vm->heap, free_object);
+    raw_reallocate(vm, MEMORY_OTHER, vm->gray_stack, sizeof(Obj *) * vm->gray_capacity, 0);
 }
\ No newline at end of file
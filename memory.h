@@ -2,15 +2,50 @@
 #define MEMORY_H
 
 #include "common.h"
+#include "value.h"
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
-#define GROW_ARRAY(type, ptr, old_count, new_count) (type *)reallocate(ptr, sizeof(type) * (old_count), sizeof(type) * (new_count))
-#define FREE_ARRAY(type, ptr, count) reallocate(ptr, sizeof(type) * (count), 0)
-#define ALLOCATE(type, count) (type *)reallocate(NULL, 0, sizeof(type) * (count))
-#define FREE(type, ptr) reallocate(ptr, sizeof(type), 0)
+#define GROW_ARRAY(vm, category, type, ptr, old_count, new_count) \
+    (type *)reallocate(vm, category, ptr, sizeof(type) * (old_count), sizeof(type) * (new_count))
+#define FREE_ARRAY(vm, category, type, ptr, count) reallocate(vm, category, ptr, sizeof(type) * (count), 0)
+#define ALLOCATE(vm, category, type, count) (type *)reallocate(vm, category, NULL, 0, sizeof(type) * (count))
+#define FREE(vm, category, type, ptr) reallocate(vm, category, ptr, sizeof(type), 0)
 
-void *reallocate(void *ptr, size_t old_size, size_t new_size);
+// Everything a VM has allocated, by category, which unlike bytes_allocated
+// includes memory the collector doesn't pace itself by.
+typedef struct
+{
+    size_t bytes[MEMORY_CATEGORY_COUNT];
+    size_t total;
+    size_t peak;
+    // Growing past this fails like running out of memory. Zero means none.
+    size_t limit;
+    // Whether the last failed allocation failed because of the limit.
+    bool over_limit;
+} MemoryStats;
 
-void free_objects();
+const char *memory_category_name(MemoryCategory category);
+void memory_stats_init(MemoryStats *stats);
+void memory_print_stats(VM *vm);
+// Moves bytes already allocated from one category to another, as heap
+// pages are handed out to objects and back.
+void memory_transfer(VM *vm, MemoryCategory from, MemoryCategory to, size_t size);
+
+// Allocates through the VM's allocator without touching the collector's
+// accounting. Returns NULL when out of memory or over the limit.
+void *raw_reallocate(VM *vm, MemoryCategory category, void *ptr, size_t old_size, size_t new_size);
+// Fails like running out of memory if handing size more bytes of the heap
+// out to an object would go over the limit, even after a collection.
+void memory_check_limit(VM *vm, size_t size);
+// Unwinds to the innermost compile or run in progress, which then fails
+// with memory_error(). Exits if there is none.
+void out_of_memory(VM *vm);
+// Says why the last allocation failed.
+const char *memory_error(VM *vm);
+void *reallocate(VM *vm, MemoryCategory category, void *ptr, size_t old_size, size_t new_size);
+void mark_object(VM *vm, Obj *object);
+void mark_value(VM *vm, Value value);
+void collect_garbage(VM *vm);
+void free_objects(VM *vm);
 
 #endif
\ No newline at end of file
@@ -1,35 +1,68 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "heap.h"
+#include "heap_profile.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
 #include "vm.h"
 #include "table.h"
 
-#define ALLOCATE_OBJ(type, object_type) (type *)allocate_object(sizeof(type), object_type)
-
-static Obj *allocate_object(size_t size, ObjType type)
+static Obj *allocate_object(VM *vm, size_t size, ObjType type)
 {
-    Obj *object = (Obj *)reallocate(NULL, 0, size);
+    memory_check_limit(vm, size);
+    Obj *object = heap_allocate(&vm->heap, size);
     object->type = type;
+    memory_transfer(vm, MEMORY_HEAP_FREE, object_category(type), size);
+
+    if (vm->heap_profile != NULL)
+    {
+        heap_profile_record(vm, object_type_name(type), size);
+    }
 
-    object->next = vm.objects;
-    vm.objects = object;
+#ifdef DEBUG_LOG_GC
+    printf("%p allocate %zu for %d\n", (void *)object, size, type);
+#endif
 
     return object;
 }
 
-static ObjString *allocate_string(char *chars, int length, uint32_t hash)
+const char *object_type_name(ObjType type)
 {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->length = length;
-    string->chars = chars;
-    string->hash = hash;
-    table_set(&vm.strings, string, NONE_VAL);
-    return string;
+    switch (type)
+    {
+    case OBJ_STRING:
+        return "string";
+    case OBJ_ROPE:
+        return "rope";
+    }
+
+    return "object";
+}
+
+MemoryCategory object_category(ObjType type)
+{
+    return type == OBJ_STRING ? MEMORY_STRINGS : MEMORY_OBJECTS;
 }
 
+// The size allocate_object() was asked for.
+size_t object_size(Obj *object)
+{
+    switch (object->type)
+    {
+    case OBJ_STRING:
+        return sizeof(ObjString) + ((ObjString *)object)->length + 1;
+    case OBJ_ROPE:
+        return sizeof(ObjRope);
+    }
+
+    return 0;
+}
+
+#if defined(HASH_FNV1A) || !defined(__SIZEOF_INT128__)
+
 static uint32_t hash_string(const char *key, int length)
 {
     uint32_t hash = 2166136261u;
@@ -43,45 +76,286 @@ static uint32_t hash_string(const char *key, int length)
     return hash;
 }
 
-ObjString *copy_string(const char *chars, int length)
+#else
+
+// wyhash: reads the key a word at a time and mixes with 64x64->128 bit
+// multiplies. Keys of up to 16 bytes, which covers most identifiers, take a
+// single multiply before the final mix.
+#define WYP0 0xa0761d6478bd642full
+#define WYP1 0xe7037ed1a0b428dbull
+#define WYP2 0x8ebc6af09c88c6e3ull
+
+static inline void wymum(uint64_t *a, uint64_t *b)
 {
-    uint32_t hash = hash_string(chars, length);
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wymix(uint64_t a, uint64_t b)
+{
+    wymum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hash_string(const char *key, int length)
+{
+    const uint8_t *p = (const uint8_t *)key;
+    size_t remaining = (size_t)length;
+    uint64_t seed = wymix(WYP0, WYP1);
+    uint64_t a;
+    uint64_t b;
+
+    if (remaining <= 16)
+    {
+        if (remaining >= 4)
+        {
+            size_t shift = (remaining >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + shift);
+            b = (read32(p + remaining - 4) << 32) | read32(p + remaining - 4 - shift);
+        }
+        else if (remaining > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[remaining >> 1] << 8) | p[remaining - 1];
+            b = 0;
+        }
+        else
+        {
+            a = 0;
+            b = 0;
+        }
+    }
+    else
+    {
+        while (remaining > 16)
+        {
+            seed = wymix(read64(p) ^ WYP1, read64(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+
+        a = read64(p + remaining - 16);
+        b = read64(p + remaining - 8);
+    }
+
+    a ^= WYP1;
+    b ^= seed;
+    wymum(&a, &b);
+    return (uint32_t)wymix(a ^ WYP2 ^ (uint64_t)length, b ^ WYP1);
+}
+
+#endif
+
+static void add_interned(VM *vm, ObjString *string)
+{
+    string->is_interned = true;
+
+    // Growing the intern table can collect, so keep the new string reachable.
+    push(vm, OBJ_VAL(string));
+    table_set(vm, &vm->strings, string, NONE_VAL);
+    pop(vm);
+}
+
+// Allocates a string with room for length characters and the terminator for
+// the caller to fill in. The result is neither hashed nor interned.
+ObjString *allocate_string(VM *vm, int length)
+{
+    ObjString *string = (ObjString *)allocate_object(vm, sizeof(ObjString) + length + 1, OBJ_STRING);
+    string->length = length;
+    string->hash = 0;
+    string->is_hashed = false;
+    string->is_interned = false;
+    string->chars[length] = '\0';
+    return string;
+}
 
-    ObjString *interned = table_find_string(&vm.strings, chars, length, hash);
+// Returns the canonical copy of a freshly built string. If an equal string
+// is already interned the new one is simply left for the collector.
+ObjString *intern_string(VM *vm, ObjString *string)
+{
+    if (string->is_interned)
+    {
+        return string;
+    }
+
+    uint32_t hash = string_hash(string);
+    ObjString *interned = table_find_string(&vm->strings, string->chars, string->length, hash);
 
     if (interned != NULL)
     {
         return interned;
     }
 
-    char *heap_chars = ALLOCATE(char, length + 1);
-    memcpy(heap_chars, chars, length);
-    heap_chars[length] = '\0';
+    add_interned(vm, string);
+    return string;
+}
+
+uint32_t string_hash(ObjString *string)
+{
+    if (!string->is_hashed)
+    {
+        string->hash = hash_string(string->chars, string->length);
+        string->is_hashed = true;
+    }
+
+    return string->hash;
+}
 
-    return allocate_string(heap_chars, length, hash);
+bool strings_equal(ObjString *a, ObjString *b)
+{
+    if (a == b)
+        return true;
+
+    // Distinct interned strings always differ.
+    if ((a->is_interned && b->is_interned) || a->length != b->length)
+        return false;
+
+    return string_hash(a) == string_hash(b) && memcmp(a->chars, b->chars, a->length) == 0;
 }
 
-ObjString *take_string(char *chars, int length)
+ObjString *copy_string(VM *vm, const char *chars, int length)
 {
     uint32_t hash = hash_string(chars, length);
 
-    ObjString *interned = table_find_string(&vm.strings, chars, length, hash);
+    ObjString *interned = table_find_string(&vm->strings, chars, length, hash);
 
     if (interned != NULL)
     {
-        FREE_ARRAY(char, chars, length + 1);
         return interned;
     }
 
-    return allocate_string(chars, length, hash);
+    ObjString *string = allocate_string(vm, length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    string->is_hashed = true;
+    add_interned(vm, string);
+    return string;
+}
+
+// Both operands must be reachable by the collector, e.g. still on the stack.
+// The result is left un-interned.
+ObjString *concatenate_strings(VM *vm, ObjString *a, ObjString *b)
+{
+    ObjString *result = allocate_string(vm, a->length + b->length);
+    memcpy(result->chars, a->chars, a->length);
+    memcpy(result->chars + a->length, b->chars, b->length);
+    return result;
+}
+
+static int text_length(Obj *object)
+{
+    return object->type == OBJ_ROPE ? ((ObjRope *)object)->length : ((ObjString *)object)->length;
+}
+
+// Concatenates two strings or ropes. Short results are copied eagerly, longer
+// ones just record both sides so repeated appends stay linear overall. Both
+// operands must be reachable by the collector.
+Obj *concatenate_ropes(VM *vm, Obj *a, Obj *b)
+{
+    int length = text_length(a) + text_length(b);
+
+    if (length < ROPE_MIN_LENGTH)
+    {
+        // Ropes are never shorter than ROPE_MIN_LENGTH, so both sides are flat.
+        return (Obj *)concatenate_strings(vm, (ObjString *)a, (ObjString *)b);
+    }
+
+    ObjRope *rope = (ObjRope *)allocate_object(vm, sizeof(ObjRope), OBJ_ROPE);
+    rope->length = length;
+    rope->left = a;
+    rope->right = b;
+    rope->flat = NULL;
+    return (Obj *)rope;
+}
+
+// Returns the characters of a string or rope as a flat string. Flattening a
+// rope allocates, so it must be reachable by the collector.
+ObjString *flatten(VM *vm, Obj *object)
+{
+    if (object->type == OBJ_STRING)
+        return (ObjString *)object;
+
+    ObjRope *rope = (ObjRope *)object;
+    if (rope->flat != NULL)
+        return rope->flat;
+
+    ObjString *result = allocate_string(vm, rope->length);
+
+    // Walk the tree in order with an explicit stack since appending in a
+    // loop builds ropes as deep as the loop is long. The stack bypasses
+    // reallocate() so it cannot start a collection mid-walk.
+    int count = 0;
+    int capacity = 0;
+    Obj **stack = NULL;
+    int offset = 0;
+    Obj *node = object;
+
+    for (;;)
+    {
+        if (node->type == OBJ_ROPE && ((ObjRope *)node)->flat == NULL)
+        {
+            if (capacity < count + 1)
+            {
+                int grown_capacity = GROW_CAPACITY(capacity);
+                Obj **grown = (Obj **)raw_reallocate(vm, MEMORY_OTHER, stack, sizeof(Obj *) * capacity,
+                                                     sizeof(Obj *) * grown_capacity);
+
+                if (grown == NULL)
+                {
+                    raw_reallocate(vm, MEMORY_OTHER, stack, sizeof(Obj *) * capacity, 0);
+                    out_of_memory(vm);
+                }
+
+                stack = grown;
+                capacity = grown_capacity;
+            }
+
+            stack[count++] = ((ObjRope *)node)->right;
+            node = ((ObjRope *)node)->left;
+            continue;
+        }
+
+        ObjString *piece = node->type == OBJ_ROPE ? ((ObjRope *)node)->flat : (ObjString *)node;
+        memcpy(result->chars + offset, piece->chars, piece->length);
+        offset += piece->length;
+
+        if (count == 0)
+            break;
+
+        node = stack[--count];
+    }
+
+    raw_reallocate(vm, MEMORY_OTHER, stack, sizeof(Obj *) * capacity, 0);
+
+    rope->flat = result;
+    rope->left = NULL;
+    rope->right = NULL;
+    return result;
 }
 
-void object_print(Value value)
+void object_print(VM *vm, Value value)
 {
     switch (OBJ_TYPE(value))
     {
     case OBJ_STRING:
         printf("%s", AS_CSTRING(value));
         break;
+    case OBJ_ROPE:
+        printf("%s", flatten(vm, AS_OBJ(value))->chars);
+        break;
     }
 }
@@ -7,32 +7,64 @@
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
 #define IS_STRING(value) is_obj_type(value, OBJ_STRING)
+#define IS_ROPE(value) is_obj_type(value, OBJ_ROPE)
+#define IS_STRING_LIKE(value) (IS_STRING(value) || IS_ROPE(value))
 
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
+
+// Concatenations shorter than this are copied straight into a flat string.
+#define ROPE_MIN_LENGTH 64
 
 typedef enum
 {
-    OBJ_STRING
+    OBJ_STRING,
+    OBJ_ROPE
 } ObjType;
 
 struct Obj
 {
     ObjType type;
-    struct Obj *next;
 };
 
+// Strings from the compiler are interned up front. Strings built at runtime
+// are only hashed and interned when something needs it, so until then they
+// have to be compared by contents.
 struct ObjString
 {
     Obj obj;
     int length;
-    char *chars;
     uint32_t hash;
+    bool is_hashed;
+    bool is_interned;
+    char chars[];
 };
 
-ObjString *take_string(char *chars, int length);
-ObjString *copy_string(const char *chars, int length);
-void object_print(Value value);
+// A lazy concatenation of two strings or ropes. It is flattened into an
+// ObjString the first time its characters are needed, after which the
+// children are dropped and the flat copy is reused.
+typedef struct
+{
+    Obj obj;
+    int length;
+    Obj *left;
+    Obj *right;
+    ObjString *flat;
+} ObjRope;
+
+const char *object_type_name(ObjType type);
+MemoryCategory object_category(ObjType type);
+size_t object_size(Obj *object);
+ObjString *allocate_string(VM *vm, int length);
+ObjString *intern_string(VM *vm, ObjString *string);
+ObjString *copy_string(VM *vm, const char *chars, int length);
+ObjString *concatenate_strings(VM *vm, ObjString *a, ObjString *b);
+Obj *concatenate_ropes(VM *vm, Obj *a, Obj *b);
+ObjString *flatten(VM *vm, Obj *object);
+uint32_t string_hash(ObjString *string);
+bool strings_equal(ObjString *a, ObjString *b);
+void object_print(VM *vm, Value value);
 
 static inline bool is_obj_type(Value value, ObjType type)
 {
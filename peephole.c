@@ -0,0 +1,137 @@
+#include "peephole.h"
+#include "common.h"
+#include "memory.h"
+
+static int instruction_length(uint8_t instruction)
+{
+    switch (instruction)
+    {
+    case OP_CONSTANT:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_ADD_CONSTANT:
+    case OP_SUBTRACT_CONSTANT:
+    case OP_MULTIPLY_CONSTANT:
+    case OP_DIVIDE_CONSTANT:
+    case OP_CONCAT_N:
+        return 2;
+    case OP_CONSTANT_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_GET_GLOBAL_LONG:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+// Comparisons whose result is immediately negated.
+static int fuse_not(uint8_t instruction)
+{
+    switch (instruction)
+    {
+    case OP_EQUAL:
+        return OP_NOT_EQUAL;
+    case OP_LESS:
+        return OP_GREATER_EQUAL;
+    case OP_GREATER:
+        return OP_LESS_EQUAL;
+    default:
+        return -1;
+    }
+}
+
+// Arithmetic whose right operand was just loaded from the constant table.
+static int fuse_constant(uint8_t instruction)
+{
+    switch (instruction)
+    {
+    case OP_ADD:
+        return OP_ADD_CONSTANT;
+    case OP_SUBTRACT:
+        return OP_SUBTRACT_CONSTANT;
+    case OP_MULTIPLY:
+        return OP_MULTIPLY_CONSTANT;
+    case OP_DIVIDE:
+        return OP_DIVIDE_CONSTANT;
+    default:
+        return -1;
+    }
+}
+
+// Line of offset in a run-length line table, advancing run forwards. Lookups
+// must come in increasing offset order.
+static int line_at(LineStart *lines, int count, int *run, int offset)
+{
+    while (*run + 1 < count && lines[*run + 1].offset <= offset)
+    {
+        (*run)++;
+    }
+
+    return lines[*run].line;
+}
+
+// Rewrites adjacent instruction pairs into superinstructions, compacting the
+// code in place and rebuilding the line table. Fused instructions take the
+// line of the second instruction of the pair since that is where a runtime
+// error would have been reported. There are no jumps yet, so no offsets need
+// patching.
+void peephole_optimize(VM *vm, Chunk *chunk)
+{
+    uint8_t *code = chunk->code;
+    LineStart *lines = chunk->lines;
+    int line_count = chunk->line_count;
+    int line_capacity = chunk->line_capacity;
+    int run = 0;
+    int read = 0;
+    int write = 0;
+
+    // Fusing never adds line changes, so the rebuilt table fits in the old
+    // one's capacity. Allocating it up front means chunk_add_line() can't run
+    // out of memory once the old table is no longer the chunk's to free.
+    chunk->lines = ALLOCATE(vm, MEMORY_LINES, LineStart, line_capacity);
+    chunk->line_count = 0;
+
+    while (read < chunk->count)
+    {
+        uint8_t instruction = code[read];
+        int length = instruction_length(instruction);
+        int next = read + length;
+
+        if (next < chunk->count)
+        {
+            uint8_t following = code[next];
+            int fused;
+
+            if (following == OP_NOT && (fused = fuse_not(instruction)) != -1)
+            {
+                code[write] = (uint8_t)fused;
+                chunk_add_line(vm, chunk, write, line_at(lines, line_count, &run, next));
+                write += 1;
+                read = next + 1;
+                continue;
+            }
+
+            if (instruction == OP_CONSTANT && (fused = fuse_constant(following)) != -1)
+            {
+                code[write] = (uint8_t)fused;
+                code[write + 1] = code[read + 1];
+                chunk_add_line(vm, chunk, write, line_at(lines, line_count, &run, next));
+                write += 2;
+                read = next + 1;
+                continue;
+            }
+        }
+
+        chunk_add_line(vm, chunk, write, line_at(lines, line_count, &run, read));
+        for (int i = 0; i < length; i++)
+        {
+            code[write + i] = code[read + i];
+        }
+
+        write += length;
+        read = next;
+    }
+
+    chunk->count = write;
+    FREE_ARRAY(vm, MEMORY_LINES, LineStart, lines, line_capacity);
+}
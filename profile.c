@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "profile.h"
+
+// How many of the busiest lines and opcode pairs to report.
+#define PROFILE_TOP 20
+
+void profile_init(Profile *profile, bool timing)
+{
+    memset(profile, 0, sizeof(Profile));
+    profile->timing = timing;
+    profile->previous = -1;
+}
+
+// The profile belongs to the host rather than the VM, so it uses the system
+// allocator and isn't counted in the VM's memory.
+void profile_free(Profile *profile)
+{
+    free(profile->offset_counts);
+    free(profile->line_counts);
+    profile_init(profile, profile->timing);
+}
+
+bool profile_begin_run(Profile *profile, Chunk *chunk)
+{
+    if (chunk->count > profile->offset_capacity)
+    {
+        uint64_t *counts = (uint64_t *)realloc(profile->offset_counts, sizeof(uint64_t) * chunk->count);
+
+        if (counts == NULL)
+            return false;
+
+        profile->offset_counts = counts;
+        profile->offset_capacity = chunk->count;
+    }
+
+    memset(profile->offset_counts, 0, sizeof(uint64_t) * chunk->count);
+    profile->chunk = chunk;
+    profile->previous = -1;
+    profile->last_time = profile_time();
+    return true;
+}
+
+static bool count_line(Profile *profile, int line, uint64_t count)
+{
+    if (line >= profile->line_capacity)
+    {
+        int capacity = profile->line_capacity < 64 ? 64 : profile->line_capacity;
+
+        while (capacity <= line)
+            capacity *= 2;
+
+        uint64_t *counts = (uint64_t *)realloc(profile->line_counts, sizeof(uint64_t) * capacity);
+
+        if (counts == NULL)
+            return false;
+
+        memset(counts + profile->line_capacity, 0, sizeof(uint64_t) * (capacity - profile->line_capacity));
+        profile->line_counts = counts;
+        profile->line_capacity = capacity;
+    }
+
+    profile->line_counts[line] += count;
+    return true;
+}
+
+void profile_end_run(Profile *profile)
+{
+    Chunk *chunk = profile->chunk;
+
+    if (chunk == NULL)
+        return;
+
+    // The last handler run is charged up to the end of the run.
+    if (profile->timing && profile->previous != -1)
+    {
+        profile->op_time[profile->previous] += profile_time() - profile->last_time;
+    }
+
+    int run = 0;
+
+    for (int offset = 0; offset < chunk->count; offset++)
+    {
+        if (profile->offset_counts[offset] == 0)
+            continue;
+
+        // Offsets only increase, so walk the line table alongside them.
+        while (run + 1 < chunk->line_count && chunk->lines[run + 1].offset <= offset)
+            run++;
+
+        if (!count_line(profile, chunk->lines[run].line, profile->offset_counts[offset]))
+            break;
+    }
+
+    profile->chunk = NULL;
+}
+
+typedef struct
+{
+    uint64_t count;
+    int key;
+} Ranked;
+
+static int compare_ranked(const void *a, const void *b)
+{
+    const Ranked *left = (const Ranked *)a;
+    const Ranked *right = (const Ranked *)b;
+
+    if (left->count != right->count)
+        return left->count < right->count ? 1 : -1;
+
+    return left->key - right->key;
+}
+
+// Sorts the non-zero counts, busiest first, into ranked, which must have
+// room for count entries. Returns how many there were.
+static int rank(const uint64_t *counts, int count, Ranked *ranked)
+{
+    int ranked_count = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (counts[i] != 0)
+        {
+            ranked[ranked_count].count = counts[i];
+            ranked[ranked_count].key = i;
+            ranked_count++;
+        }
+    }
+
+    qsort(ranked, ranked_count, sizeof(Ranked), compare_ranked);
+    return ranked_count;
+}
+
+static double percent(uint64_t part, uint64_t total)
+{
+    return total == 0 ? 0.0 : 100.0 * (double)part / (double)total;
+}
+
+void profile_report(Profile *profile, FILE *file)
+{
+    uint64_t total = 0;
+    uint64_t total_time = 0;
+
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        total += profile->op_counts[op];
+        total_time += profile->op_time[op];
+    }
+
+    fprintf(file, "Profile: %llu instructions executed\n", (unsigned long long)total);
+
+    Ranked ops[OP_COUNT];
+    int op_count = rank(profile->op_counts, OP_COUNT, ops);
+
+    fprintf(file, "\n%14s %6s", "count", "%");
+    if (profile->timing)
+        fprintf(file, " %14s %6s %8s", PROFILE_TIME_UNIT, "%", "per op");
+    fprintf(file, "  opcode\n");
+
+    for (int i = 0; i < op_count; i++)
+    {
+        int op = ops[i].key;
+        fprintf(file, "%14llu %5.1f%%", (unsigned long long)ops[i].count, percent(ops[i].count, total));
+
+        if (profile->timing)
+        {
+            fprintf(file, " %14llu %5.1f%% %8.1f", (unsigned long long)profile->op_time[op],
+                    percent(profile->op_time[op], total_time), (double)profile->op_time[op] / (double)ops[i].count);
+        }
+
+        fprintf(file, "  %s\n", opcode_name((uint8_t)op));
+    }
+
+    Ranked *lines = (Ranked *)malloc(sizeof(Ranked) * (profile->line_capacity + 1));
+
+    if (lines != NULL)
+    {
+        int line_count = rank(profile->line_counts, profile->line_capacity, lines);
+        fprintf(file, "\n%14s %6s  line\n", "count", "%");
+
+        for (int i = 0; i < line_count && i < PROFILE_TOP; i++)
+        {
+            fprintf(file, "%14llu %5.1f%%  %d\n", (unsigned long long)lines[i].count, percent(lines[i].count, total),
+                    lines[i].key);
+        }
+
+        free(lines);
+    }
+
+    // Pairs are ranked by their index in the flattened table.
+    Ranked *pairs = (Ranked *)malloc(sizeof(Ranked) * OP_COUNT * OP_COUNT);
+
+    if (pairs != NULL)
+    {
+        int pair_count = rank(&profile->pair_counts[0][0], OP_COUNT * OP_COUNT, pairs);
+        fprintf(file, "\n%14s %6s  opcode pair\n", "count", "%");
+
+        for (int i = 0; i < pair_count && i < PROFILE_TOP; i++)
+        {
+            fprintf(file, "%14llu %5.1f%%  %s -> %s\n", (unsigned long long)pairs[i].count,
+                    percent(pairs[i].count, total), opcode_name((uint8_t)(pairs[i].key / OP_COUNT)),
+                    opcode_name((uint8_t)(pairs[i].key % OP_COUNT)));
+        }
+
+        free(pairs);
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+
+#include "chunk.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_TIME_UNIT "cycles"
+#else
+#include <time.h>
+#define PROFILE_TIME_UNIT "ns"
+#endif
+
+// Counts what run_profiled() executes: each opcode, each pair of opcodes
+// executed one after the other, and each source line. With timing on it
+// also charges every handler the time until the next dispatch.
+typedef struct Profile
+{
+    bool timing;
+    uint64_t op_counts[OP_COUNT];
+    uint64_t op_time[OP_COUNT];
+    uint64_t pair_counts[OP_COUNT][OP_COUNT];
+    // Counts by offset into the chunk being run, folded into line_counts
+    // once the run ends so the loop doesn't look lines up as it goes.
+    Chunk *chunk;
+    uint64_t *offset_counts;
+    int offset_capacity;
+    uint64_t *line_counts;
+    int line_capacity;
+    // The opcode dispatched last this run, or -1 before the first.
+    int previous;
+    uint64_t last_time;
+} Profile;
+
+void profile_init(Profile *profile, bool timing);
+void profile_free(Profile *profile);
+// Bracket a run of chunk. Returns false if the profile couldn't make room
+// for the chunk, in which case the run shouldn't be profiled.
+bool profile_begin_run(Profile *profile, Chunk *chunk);
+void profile_end_run(Profile *profile);
+void profile_report(Profile *profile, FILE *file);
+
+static inline uint64_t profile_time(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// Called by run_profiled() before dispatching the instruction at ip.
+static inline void profile_instruction(Profile *profile, Chunk *chunk, uint8_t *ip)
+{
+    int op = *ip;
+
+    profile->op_counts[op]++;
+    profile->offset_counts[ip - chunk->code]++;
+
+    if (profile->previous != -1)
+    {
+        profile->pair_counts[profile->previous][op]++;
+    }
+
+    if (profile->timing)
+    {
+        uint64_t now = profile_time();
+
+        if (profile->previous != -1)
+        {
+            profile->op_time[profile->previous] += now - profile->last_time;
+        }
+
+        profile->last_time = now;
+    }
+
+    profile->previous = op;
+}
+
+#endif
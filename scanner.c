@@ -4,96 +4,94 @@
 #include <string.h>
 #include <stdio.h>
 
-Scanner scanner;
-
-void scanner_init(const char *source)
+void scanner_init(Scanner *scanner, const char *source)
 {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+    scanner->start = source;
+    scanner->current = source;
+    scanner->line = 1;
 }
 
-static bool is_at_end()
+static bool is_at_end(Scanner *scanner)
 {
-    return *scanner.current == '\0';
+    return *scanner->current == '\0';
 }
 
-static Token make_token(TokenType type)
+static Token make_token(Scanner *scanner, TokenType type)
 {
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
     return token;
 }
 
-static Token error_token(const char *message)
+static Token error_token(Scanner *scanner, const char *message)
 {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int)strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
     return token;
 }
 
-static char advance()
+static char advance(Scanner *scanner)
 {
-    scanner.current++;
-    return scanner.current[-1];
+    scanner->current++;
+    return scanner->current[-1];
 }
 
-static bool match(char expected)
+static bool match(Scanner *scanner, char expected)
 {
-    if (is_at_end())
+    if (is_at_end(scanner))
     {
         return false;
     }
-    if (*scanner.current != expected)
+    if (*scanner->current != expected)
     {
         return false;
     }
 
-    scanner.current++;
+    scanner->current++;
     return true;
 }
 
-static char peek()
+static char peek(Scanner *scanner)
 {
-    return *scanner.current;
+    return *scanner->current;
 }
 
-static char peek_next()
+static char peek_next(Scanner *scanner)
 {
-    if (is_at_end())
+    if (is_at_end(scanner))
         return '\0';
 
-    return scanner.current[1];
+    return scanner->current[1];
 }
 
-static void skip_whitespace()
+static void skip_whitespace(Scanner *scanner)
 {
     for (;;)
     {
-        char c = peek();
+        char c = peek(scanner);
         switch (c)
         {
         case ' ':
         case '\r':
         case '\t':
-            advance();
+            advance(scanner);
             break;
         case '\n':
-            scanner.line++;
-            advance();
+            scanner->line++;
+            advance(scanner);
             break;
         case '/':
-            if (peek_next() == '/')
+            if (peek_next(scanner) == '/')
             {
                 // A comment goes until the end of the line.
-                while (peek() != '\n' && !is_at_end())
-                    advance();
+                while (peek(scanner) != '\n' && !is_at_end(scanner))
+                    advance(scanner);
             }
             else
             {
@@ -106,21 +104,21 @@ static void skip_whitespace()
     }
 }
 
-static Token string()
+static Token string(Scanner *scanner)
 {
-    while (peek() != '"' && !is_at_end())
+    while (peek(scanner) != '"' && !is_at_end(scanner))
     {
-        if (peek() == '\n')
-            scanner.line++;
-        advance();
+        if (peek(scanner) == '\n')
+            scanner->line++;
+        advance(scanner);
     }
 
-    if (is_at_end())
-        return error_token("Unterminated string.");
+    if (is_at_end(scanner))
+        return error_token(scanner, "Unterminated string.");
 
     // The closing quote.
-    advance();
-    return make_token(TOKEN_STRING);
+    advance(scanner);
+    return make_token(scanner, TOKEN_STRING);
 }
 
 static bool is_digit(char c)
@@ -128,22 +126,22 @@ static bool is_digit(char c)
     return c >= '0' && c <= '9';
 }
 
-static Token number()
+static Token number(Scanner *scanner)
 {
-    while (is_digit(peek()))
-        advance();
+    while (is_digit(peek(scanner)))
+        advance(scanner);
 
     // Look for a fractional part.
-    if (peek() == '.' && is_digit(peek_next()))
+    if (peek(scanner) == '.' && is_digit(peek_next(scanner)))
     {
         // Consume the "."
-        advance();
+        advance(scanner);
 
-        while (is_digit(peek()))
-            advance();
+        while (is_digit(peek(scanner)))
+            advance(scanner);
     }
 
-    return make_token(TOKEN_NUMBER);
+    return make_token(scanner, TOKEN_NUMBER);
 }
 
 static bool is_alpha(char c)
@@ -153,10 +151,10 @@ static bool is_alpha(char c)
            c == '_';
 }
 
-static TokenType check_keyword(int start, int length, const char *rest, TokenType type)
+static TokenType check_keyword(Scanner *scanner, int start, int length, const char *rest, TokenType type)
 {
-    if (scanner.current - scanner.start == start + length &&
-        memcmp(scanner.start + start, rest, length) == 0)
+    if (scanner->current - scanner->start == start + length &&
+        memcmp(scanner->start + start, rest, length) == 0)
     {
         return type;
     }
@@ -164,120 +162,120 @@ static TokenType check_keyword(int start, int length, const char *rest, TokenTyp
     return TOKEN_IDENTIFIER;
 }
 
-static TokenType identifier_type()
+static TokenType identifier_type(Scanner *scanner)
 {
-    switch (scanner.start[0])
+    switch (scanner->start[0])
     {
     case 'a':
-        return check_keyword(1, 2, "nd", TOKEN_AND);
+        return check_keyword(scanner, 1, 2, "nd", TOKEN_AND);
     case 'c':
-        return check_keyword(1, 4, "lass", TOKEN_CLASS);
+        return check_keyword(scanner, 1, 4, "lass", TOKEN_CLASS);
     case 'd':
-        return check_keyword(1, 2, "ef", TOKEN_DEF);
+        return check_keyword(scanner, 1, 2, "ef", TOKEN_DEF);
     case 'e':
-        return check_keyword(1, 3, "lse", TOKEN_ELSE);
+        return check_keyword(scanner, 1, 3, "lse", TOKEN_ELSE);
     case 'f':
-        return check_keyword(1, 2, "or", TOKEN_FOR);
+        return check_keyword(scanner, 1, 2, "or", TOKEN_FOR);
     case 'F':
-        return check_keyword(1, 4, "alse", TOKEN_FALSE);
+        return check_keyword(scanner, 1, 4, "alse", TOKEN_FALSE);
     case 'i':
-        if (scanner.current - scanner.start > 1)
+        if (scanner->current - scanner->start > 1)
         {
-            switch (scanner.start[1])
+            switch (scanner->start[1])
             {
             case 'f':
-                return check_keyword(2, 1, "", TOKEN_IF);
+                return check_keyword(scanner, 2, 1, "", TOKEN_IF);
             case 's':
-                return check_keyword(2, 1, "s", TOKEN_IS);
+                return check_keyword(scanner, 2, 1, "s", TOKEN_IS);
             }
         }
         break;
     case 'N':
-        return check_keyword(1, 3, "one", TOKEN_NONE);
+        return check_keyword(scanner, 1, 3, "one", TOKEN_NONE);
     case 'n':
-        return check_keyword(1, 2, "ot", TOKEN_NOT);
+        return check_keyword(scanner, 1, 2, "ot", TOKEN_NOT);
     case 'o':
-        return check_keyword(1, 1, "r", TOKEN_OR);
+        return check_keyword(scanner, 1, 1, "r", TOKEN_OR);
     case 'p':
-        return check_keyword(1, 4, "rint", TOKEN_PRINT);
+        return check_keyword(scanner, 1, 4, "rint", TOKEN_PRINT);
     case 'r':
-        return check_keyword(1, 5, "eturn", TOKEN_RETURN);
+        return check_keyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
     case 'T':
-        return check_keyword(1, 3, "rue", TOKEN_TRUE);
+        return check_keyword(scanner, 1, 3, "rue", TOKEN_TRUE);
     case 'v':
-        return check_keyword(1, 2, "ar", TOKEN_VAR);
+        return check_keyword(scanner, 1, 2, "ar", TOKEN_VAR);
     case 'w':
-        return check_keyword(1, 4, "hile", TOKEN_WHILE);
+        return check_keyword(scanner, 1, 4, "hile", TOKEN_WHILE);
     }
 
     return TOKEN_IDENTIFIER;
 }
 
-static Token identifier()
+static Token identifier(Scanner *scanner)
 {
-    while (is_alpha(peek()) || is_digit(peek()))
-        advance();
+    while (is_alpha(peek(scanner)) || is_digit(peek(scanner)))
+        advance(scanner);
 
-    return make_token(identifier_type());
+    return make_token(scanner, identifier_type(scanner));
 }
 
-Token scan_token()
+Token scan_token(Scanner *scanner)
 {
-    skip_whitespace();
+    skip_whitespace(scanner);
 
-    scanner.start = scanner.current;
+    scanner->start = scanner->current;
 
-    if (is_at_end())
+    if (is_at_end(scanner))
     {
-        return make_token(TOKEN_EOF);
+        return make_token(scanner, TOKEN_EOF);
     }
 
-    char c = advance();
+    char c = advance(scanner);
 
     if (is_alpha(c))
     {
-        return identifier();
+        return identifier(scanner);
     }
     else if (is_digit(c))
     {
-        return number();
+        return number(scanner);
     }
 
     switch (c)
     {
     case '(':
-        return make_token(TOKEN_LEFT_PAREN);
+        return make_token(scanner, TOKEN_LEFT_PAREN);
     case ')':
-        return make_token(TOKEN_RIGHT_PAREN);
+        return make_token(scanner, TOKEN_RIGHT_PAREN);
     case '{':
-        return make_token(TOKEN_LEFT_BRACE);
+        return make_token(scanner, TOKEN_LEFT_BRACE);
     case '}':
-        return make_token(TOKEN_RIGHT_BRACE);
+        return make_token(scanner, TOKEN_RIGHT_BRACE);
     case ';':
-        return make_token(TOKEN_SEMICOLON);
+        return make_token(scanner, TOKEN_SEMICOLON);
     case ',':
-        return make_token(TOKEN_COMMA);
+        return make_token(scanner, TOKEN_COMMA);
     case '.':
-        return make_token(TOKEN_DOT);
+        return make_token(scanner, TOKEN_DOT);
     case '-':
-        return make_token(TOKEN_MINUS);
+        return make_token(scanner, TOKEN_MINUS);
     case '+':
-        return make_token(TOKEN_PLUS);
+        return make_token(scanner, TOKEN_PLUS);
     case '/':
-        return make_token(TOKEN_SLASH);
+        return make_token(scanner, TOKEN_SLASH);
     case '*':
-        return make_token(TOKEN_STAR);
+        return make_token(scanner, TOKEN_STAR);
     case '!':
-        return make_token(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+        return make_token(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
     case '=':
-        return make_token(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+        return make_token(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
     case '<':
-        return make_token(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+        return make_token(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
     case '>':
-        return make_token(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+        return make_token(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
     case '"':
-        return string();
+        return string(scanner);
     }
 
-    return error_token("Unexpected character.");
+    return error_token(scanner, "Unexpected character.");
 }
\ No newline at end of file
@@ -63,7 +63,7 @@ typedef struct
     int line;
 } Token;
 
-void scanner_init(const char *source);
-Token scan_token();
+void scanner_init(Scanner *scanner, const char *source);
+Token scan_token(Scanner *scanner);
 
 #endif
\ No newline at end of file
@@ -1,114 +1,223 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "heap.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define MAX_LOAD 0.75
+// Slots in use, live or deleted, may fill at most 7/8 of the table so every
+// probe sequence is guaranteed to reach an empty slot.
+#define MAX_LOAD_NUMERATOR 7
+#define MAX_LOAD_DENOMINATOR 8
+
+#define CONTROL_EMPTY ((int8_t)-128)
+#define CONTROL_DELETED ((int8_t)-2)
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((int8_t)((hash) & 0x7f))
 
 void table_init(Table *table)
 {
     table->count = 0;
+    table->used = 0;
     table->capacity = 0;
+    table->control = NULL;
     table->entries = NULL;
 }
 
-void table_free(Table *table)
+// The entries and control bytes share one allocation, entries first, so
+// running out of memory can't leave a table with only one of them. The
+// first group of control bytes is mirrored past the end so a group can be
+// loaded from any slot without wrapping.
+static size_t table_bytes(int capacity)
+{
+    return sizeof(Entry) * capacity + capacity + TABLE_GROUP_SIZE;
+}
+
+void table_free(VM *vm, Table *table)
 {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    // An empty table has no allocation at all.
+    if (table->entries != NULL)
+    {
+        reallocate(vm, MEMORY_TABLES, table->entries, table_bytes(table->capacity), 0);
+    }
+
     table_init(table);
 }
 
-static Entry *find_entry(Entry *entries, int capacity, ObjString *key)
+// Bitmask of the slots in the group starting at group whose control byte is
+// value.
+static uint32_t match_byte(const int8_t *group, int8_t value)
 {
-    uint32_t index = key->hash % capacity;
-    Entry *tombstrone = NULL;
+#ifdef __SSE2__
+    __m128i control = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(value)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++)
+    {
+        if (group[i] == value)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
 
-    for (;;)
+// Bitmask of the empty or deleted slots in a group, the only control bytes
+// with the sign bit set.
+static uint32_t match_free(const int8_t *group)
+{
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++)
     {
-        Entry *entry = &entries[index];
+        if (group[i] < 0)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
 
-        if (entry->key == NULL)
+static void set_control(Table *table, int index, int8_t value)
+{
+    table->control[index] = value;
+
+    if (index < TABLE_GROUP_SIZE)
+    {
+        table->control[table->capacity + index] = value;
+    }
+}
+
+// Index of key's entry, or -1 if it is not in the table.
+static int find_entry(Table *table, ObjString *key)
+{
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint32_t position = H1(key->hash) & mask;
+    int8_t fragment = H2(key->hash);
+
+    for (uint32_t stride = TABLE_GROUP_SIZE;; stride += TABLE_GROUP_SIZE)
+    {
+        const int8_t *group = &table->control[position];
+
+        for (uint32_t matches = match_byte(group, fragment); matches != 0; matches &= matches - 1)
         {
-            if (IS_NONE(entry->value))
-            {
-                return tombstrone != NULL ? tombstrone : entry;
-            }
-            else
+            uint32_t index = (position + __builtin_ctz(matches)) & mask;
+            if (table->entries[index].key == key)
             {
-                if (tombstrone == NULL)
-                {
-                    tombstrone = entry;
-                }
+                return (int)index;
             }
         }
-        else if (entry->key == key)
+
+        if (match_byte(group, CONTROL_EMPTY) != 0)
         {
-            return entry;
+            return -1;
         }
 
-        index = (index + 1) % capacity;
+        position = (position + stride) & mask;
     }
 }
 
-static void adjust_capacity(Table *table, int capacity)
+// Index of the first empty or deleted slot on hash's probe sequence.
+static int find_free_slot(Table *table, uint32_t hash)
 {
-    Entry *entries = ALLOCATE(Entry, capacity);
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint32_t position = H1(hash) & mask;
 
+    for (uint32_t stride = TABLE_GROUP_SIZE;; stride += TABLE_GROUP_SIZE)
+    {
+        uint32_t matches = match_free(&table->control[position]);
+
+        if (matches != 0)
+        {
+            return (int)((position + __builtin_ctz(matches)) & mask);
+        }
+
+        position = (position + stride) & mask;
+    }
+}
+
+static void insert_new(Table *table, ObjString *key, Value value)
+{
+    int index = find_free_slot(table, key->hash);
+
+    if (table->control[index] == CONTROL_EMPTY)
+    {
+        table->used++;
+    }
+
+    set_control(table, index, H2(key->hash));
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+    table->count++;
+}
+
+// Rehashes into a table of the given power-of-two capacity, which also
+// clears out any deleted slots.
+static void adjust_capacity(VM *vm, Table *table, int capacity)
+{
+    Table resized;
+    resized.count = 0;
+    resized.used = 0;
+    resized.capacity = capacity;
+    resized.entries = (Entry *)reallocate(vm, MEMORY_TABLES, NULL, 0, table_bytes(capacity));
+    resized.control = (int8_t *)(resized.entries + capacity);
+
+    memset(resized.control, (uint8_t)CONTROL_EMPTY, capacity + TABLE_GROUP_SIZE);
     for (int i = 0; i < capacity; i++)
     {
-        entries[i].key = NULL;
-        entries[i].value = NONE_VAL;
+        resized.entries[i].key = NULL;
+        resized.entries[i].value = NONE_VAL;
     }
 
-    table->count = 0;
     for (int i = 0; i < table->capacity; i++)
     {
         Entry *entry = &table->entries[i];
 
-        if (entry->key == NULL)
+        if (entry->key != NULL)
         {
-            continue;
+            insert_new(&resized, entry->key, entry->value);
         }
-
-        Entry *dest = find_entry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-
-    table->entries = entries;
-    table->capacity = capacity;
+    table_free(vm, table);
+    *table = resized;
 }
 
-bool table_set(Table *table, ObjString *key, Value value)
+bool table_set(VM *vm, Table *table, ObjString *key, Value value)
 {
-    if (table->count + 1 > table->capacity * MAX_LOAD)
+    if (table->capacity > 0)
     {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjust_capacity(table, capacity);
-    }
+        int index = find_entry(table, key);
 
-    Entry *entry = find_entry(table->entries, table->capacity, key);
-    bool is_new_key = entry->key == NULL;
-
-    if (is_new_key && IS_NONE(entry->value))
-    {
-        table->count++;
+        if (index != -1)
+        {
+            table->entries[index].value = value;
+            return false;
+        }
     }
 
-    if (is_new_key && IS_NONE(entry->value))
+    if ((table->used + 1) * MAX_LOAD_DENOMINATOR > table->capacity * MAX_LOAD_NUMERATOR)
     {
-        table->count++;
+        // Only grow if live entries need the room, otherwise rehashing at
+        // the same size is enough to reclaim the deleted slots.
+        int capacity = table->capacity < TABLE_GROUP_SIZE ? TABLE_GROUP_SIZE : table->capacity;
+        if ((table->count + 1) * 2 > capacity)
+        {
+            capacity *= 2;
+        }
+        adjust_capacity(vm, table, capacity);
     }
 
-    entry->key = key;
-    entry->value = value;
-    return is_new_key;
+    insert_new(table, key, value);
+    return true;
 }
 
 bool table_get(Table *table, ObjString *key, Value *value)
@@ -118,13 +227,13 @@ bool table_get(Table *table, ObjString *key, Value *value)
         return false;
     }
 
-    Entry *entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    int index = find_entry(table, key);
+    if (index == -1)
     {
         return false;
     }
 
-    *value = entry->value;
+    *value = table->entries[index].value;
     return true;
 }
 
@@ -135,27 +244,29 @@ bool table_delete(Table *table, ObjString *key)
         return false;
     }
 
-    Entry *entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    int index = find_entry(table, key);
+    if (index == -1)
     {
         return false;
     }
 
-    // tombstone
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    // Deleted slots keep probe sequences that ran through them intact.
+    set_control(table, index, CONTROL_DELETED);
+    table->entries[index].key = NULL;
+    table->entries[index].value = NONE_VAL;
+    table->count--;
 
     return true;
 }
 
-void table_add_all(Table *from, Table *to)
+void table_add_all(VM *vm, Table *from, Table *to)
 {
     for (int i = 0; i < from->capacity; i++)
     {
         Entry *entry = &from->entries[i];
         if (entry->key != NULL)
         {
-            table_set(to, entry->key, entry->value);
+            table_set(vm, to, entry->key, entry->value);
         }
     }
 }
@@ -167,24 +278,50 @@ ObjString *table_find_string(Table *table, const char *chars, int length, uint32
         return NULL;
     }
 
-    uint32_t index = hash % table->capacity;
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint32_t position = H1(hash) & mask;
+    int8_t fragment = H2(hash);
 
-    for (;;)
+    for (uint32_t stride = TABLE_GROUP_SIZE;; stride += TABLE_GROUP_SIZE)
     {
-        Entry *entry = &table->entries[index];
+        const int8_t *group = &table->control[position];
 
-        if (entry->key == NULL)
+        for (uint32_t matches = match_byte(group, fragment); matches != 0; matches &= matches - 1)
         {
-            if (IS_NONE(entry->value))
+            ObjString *key = table->entries[(position + __builtin_ctz(matches)) & mask].key;
+            if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0)
             {
-                return NULL;
+                return key;
             }
         }
-        else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0)
+
+        if (match_byte(group, CONTROL_EMPTY) != 0)
+        {
+            return NULL;
+        }
+
+        position = (position + stride) & mask;
+    }
+}
+
+void table_remove_white(Table *table)
+{
+    for (int i = 0; i < table->capacity; i++)
+    {
+        Entry *entry = &table->entries[i];
+        if (entry->key != NULL && !heap_is_marked((Obj *)entry->key))
         {
-            return entry->key;
+            table_delete(table, entry->key);
         }
+    }
+}
 
-        index = (index + 1) % table->capacity;
+void mark_table(VM *vm, Table *table)
+{
+    for (int i = 0; i < table->capacity; i++)
+    {
+        Entry *entry = &table->entries[i];
+        mark_object(vm, (Obj *)entry->key);
+        mark_value(vm, entry->value);
     }
 }
\ No newline at end of file
@@ -11,20 +11,30 @@ typedef struct
     Value value;
 } Entry;
 
+// A Swiss table: control holds one byte per slot, either the low 7 bits of
+// the key's hash or an empty/deleted marker, and is scanned a group of
+// TABLE_GROUP_SIZE slots at a time. Keys are compared by identity, so they
+// must be interned strings. Unused entries always have a NULL key.
+#define TABLE_GROUP_SIZE 16
+
 typedef struct
 {
     int count;
+    int used;
     int capacity;
+    int8_t *control;
     Entry *entries;
 } Table;
 
 void table_init(Table *table);
-void table_free(Table *table);
-bool table_set(Table *table, ObjString *key, Value value);
+void table_free(VM *vm, Table *table);
+bool table_set(VM *vm, Table *table, ObjString *key, Value value);
 bool table_get(Table *table, ObjString *key, Value *value);
 bool table_delete(Table *table, ObjString *key);
-void table_add_all(Table *from, Table *to);
+void table_add_all(VM *vm, Table *from, Table *to);
 
 ObjString *table_find_string(Table *table, const char *chars, int length, uint32_t hash);
+void table_remove_white(Table *table);
+void mark_table(VM *vm, Table *table);
 
 #endif
\ No newline at end of file
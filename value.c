@@ -12,27 +12,45 @@ void value_array_init(ValueArray *array)
     array->values = NULL;
 }
 
-void value_array_free(ValueArray *array)
+void value_array_free(VM *vm, MemoryCategory category, ValueArray *array)
 {
-    FREE_ARRAY(Value, array->values, array->capacity);
+    FREE_ARRAY(vm, category, Value, array->values, array->capacity);
     value_array_init(array);
 }
 
-void value_array_write(ValueArray *array, Value value)
+void value_array_write(VM *vm, MemoryCategory category, ValueArray *array, Value value)
 {
     if (array->capacity < array->count + 1)
     {
-        int old_capacity = array->capacity;
-        array->capacity = GROW_CAPACITY(old_capacity);
-        array->values = GROW_ARRAY(Value, array->values, old_capacity, array->capacity);
+        int capacity = GROW_CAPACITY(array->capacity);
+        array->values = GROW_ARRAY(vm, category, Value, array->values, array->capacity, capacity);
+        array->capacity = capacity;
     }
 
     array->values[array->count] = value;
     array->count++;
 }
 
-void value_print(Value value)
+void value_print(VM *vm, Value value)
 {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value))
+    {
+        printf(AS_BOOL(value) ? "True" : "False");
+    }
+    else if (IS_NONE(value))
+    {
+        printf("None");
+    }
+    else if (IS_NUMBER(value))
+    {
+        printf("%g", AS_NUMBER(value));
+    }
+    else if (IS_OBJ(value))
+    {
+        object_print(vm, value);
+    }
+#else
     switch (value.type)
     {
     case VAL_BOOL:
@@ -45,13 +63,26 @@ void value_print(Value value)
         printf("%g", AS_NUMBER(value));
         break;
     case VAL_OBJ:
-        object_print(value);
+        object_print(vm, value);
         break;
     }
+#endif
 }
 
-bool values_equal(Value a, Value b)
+bool values_equal(VM *vm, Value a, Value b)
 {
+#ifdef NAN_BOXING
+    // Compare numbers as doubles so NaN != NaN, everything else by bits.
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+    {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    if (IS_STRING_LIKE(a) && IS_STRING_LIKE(b))
+    {
+        return strings_equal(flatten(vm, AS_OBJ(a)), flatten(vm, AS_OBJ(b)));
+    }
+    return a == b;
+#else
     if (a.type != b.type)
         return false;
     switch (a.type)
@@ -63,8 +94,11 @@ bool values_equal(Value a, Value b)
     case VAL_NUMBER:
         return AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_OBJ:
+        if (IS_STRING_LIKE(a) && IS_STRING_LIKE(b))
+            return strings_equal(flatten(vm, AS_OBJ(a)), flatten(vm, AS_OBJ(b)));
         return AS_OBJ(a) == AS_OBJ(b);
     default:
         return false; // Unreachable.
     }
+#endif
 }
\ No newline at end of file
@@ -1,11 +1,60 @@
 #ifndef VALUE_H
 #define VALUE_H
 
+#include <string.h>
+
 #include "common.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+// A Value is a single 64-bit word. Any non-NaN bit pattern is a double, and
+// the remaining quiet NaN space carries the other types: a sign bit plus quiet
+// NaN marks an Obj pointer in the low 48 bits, otherwise the two lowest bits
+// tag None, False and True.
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NONE 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+
+typedef uint64_t Value;
+
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NONE(value) ((value) == NONE_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_OBJ(value) ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) value_to_num(value)
+
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NONE_VAL ((Value)(uint64_t)(QNAN | TAG_NONE))
+#define NUMBER_VAL(num) num_to_value(num)
+#define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+static inline double value_to_num(Value value)
+{
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value num_to_value(double num)
+{
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
+
 typedef enum
 {
     VAL_BOOL,
@@ -39,6 +88,8 @@ typedef struct
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj *)object}})
 
+#endif
+
 typedef struct
 {
     int count;
@@ -47,10 +98,10 @@ typedef struct
 } ValueArray;
 
 void value_array_init(ValueArray *array);
-void value_array_free(ValueArray *array);
-void value_array_write(ValueArray *array, Value value);
-void value_print(Value value);
+void value_array_free(VM *vm, MemoryCategory category, ValueArray *array);
+void value_array_write(VM *vm, MemoryCategory category, ValueArray *array, Value value);
+void value_print(VM *vm, Value value);
 
-bool values_equal(Value a, Value b);
+bool values_equal(VM *vm, Value a, Value b);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,216 @@
+#include "verify.h"
+#include "vm.h"
+
+typedef enum
+{
+    OPERAND_NONE,
+    OPERAND_CONSTANT,
+    OPERAND_GLOBAL,
+    OPERAND_COUNT,
+} OperandKind;
+
+typedef struct
+{
+    Chunk *chunk;
+    VerifyError *error;
+} Verifier;
+
+static bool reject(Verifier *verifier, int offset, const char *message)
+{
+    if (verifier->error != NULL)
+    {
+        verifier->error->offset = offset;
+        verifier->error->message = message;
+    }
+
+    return false;
+}
+
+// The line table must cover the code from its first byte, in order.
+static bool verify_lines(Verifier *verifier)
+{
+    Chunk *chunk = verifier->chunk;
+
+    if (chunk->line_count == 0 || chunk->lines[0].offset != 0)
+    {
+        return reject(verifier, 0, "Line table doesn't start at the first instruction.");
+    }
+
+    for (int i = 1; i < chunk->line_count; i++)
+    {
+        if (chunk->lines[i].offset <= chunk->lines[i - 1].offset || chunk->lines[i].offset >= chunk->count)
+        {
+            return reject(verifier, chunk->lines[i].offset, "Line table is out of order.");
+        }
+    }
+
+    return true;
+}
+
+bool verify_chunk(VM *vm, Chunk *chunk, VerifyError *error)
+{
+    Verifier verifier = {chunk, error};
+
+    if (chunk->count == 0 || chunk->code[chunk->count - 1] != OP_RETURN)
+    {
+        return reject(&verifier, chunk->count, "Code doesn't end with a return.");
+    }
+
+    if (!verify_lines(&verifier))
+    {
+        return false;
+    }
+
+    int depth = 0;
+    int offset = 0;
+
+    while (offset < chunk->count)
+    {
+        uint8_t *code = &chunk->code[offset];
+        int length = 1;
+        int pops = 0;
+        int pushes = 0;
+        // Slots the instruction uses above its operands while it runs.
+        int scratch = 0;
+        OperandKind kind = OPERAND_NONE;
+
+        switch (*code)
+        {
+        case OP_CONSTANT:
+            length = 2;
+            kind = OPERAND_CONSTANT;
+            pushes = 1;
+            break;
+        case OP_CONSTANT_LONG:
+            length = 4;
+            kind = OPERAND_CONSTANT;
+            pushes = 1;
+            break;
+        case OP_GET_GLOBAL:
+            length = 2;
+            kind = OPERAND_GLOBAL;
+            pushes = 1;
+            break;
+        case OP_GET_GLOBAL_LONG:
+            length = 4;
+            kind = OPERAND_GLOBAL;
+            pushes = 1;
+            break;
+        case OP_DEFINE_GLOBAL:
+            length = 2;
+            kind = OPERAND_GLOBAL;
+            pops = 1;
+            break;
+        case OP_DEFINE_GLOBAL_LONG:
+            length = 4;
+            kind = OPERAND_GLOBAL;
+            pops = 1;
+            break;
+        case OP_NONE:
+        case OP_TRUE:
+        case OP_FALSE:
+            pushes = 1;
+            break;
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_EQUAL_NUM:
+        case OP_NOT_EQUAL_NUM:
+            pops = 2;
+            pushes = 1;
+            break;
+        case OP_NOT:
+        case OP_NEGATE:
+            pops = 1;
+            pushes = 1;
+            break;
+        case OP_ADD_CONSTANT:
+            length = 2;
+            kind = OPERAND_CONSTANT;
+            pops = 1;
+            pushes = 1;
+            // Adding anything but numbers pushes the constant to add it.
+            scratch = 1;
+            break;
+        case OP_SUBTRACT_CONSTANT:
+        case OP_MULTIPLY_CONSTANT:
+        case OP_DIVIDE_CONSTANT:
+            length = 2;
+            kind = OPERAND_CONSTANT;
+            pops = 1;
+            pushes = 1;
+            break;
+        case OP_CONCAT_N:
+            length = 2;
+            kind = OPERAND_COUNT;
+            pushes = 1;
+            // Mixed operands are added pairwise on top of the rest.
+            scratch = 2;
+            break;
+        case OP_PRINT:
+        case OP_POP:
+            pops = 1;
+            break;
+        case OP_RETURN:
+            if (depth != 0)
+            {
+                return reject(&verifier, offset, "Stack isn't empty on return.");
+            }
+            break;
+        default:
+            return reject(&verifier, offset, "Unknown opcode.");
+        }
+
+        if (offset + length > chunk->count)
+        {
+            return reject(&verifier, offset, "Operand runs past the end of the code.");
+        }
+
+        int operand = length == 4 ? (code[1] << 16) | (code[2] << 8) | code[3] : code[length - 1];
+
+        if (kind == OPERAND_CONSTANT && operand >= chunk->constants.count)
+        {
+            return reject(&verifier, offset, "Constant index out of range.");
+        }
+
+        if (kind == OPERAND_GLOBAL && operand >= vm->global_values.count)
+        {
+            return reject(&verifier, offset, "Global slot out of range.");
+        }
+
+        if (kind == OPERAND_COUNT)
+        {
+            if (operand == 0)
+            {
+                return reject(&verifier, offset, "Concatenation of no operands.");
+            }
+
+            pops = operand;
+        }
+
+        if (depth < pops)
+        {
+            return reject(&verifier, offset, "Stack underflow.");
+        }
+
+        if (depth + scratch > chunk->max_stack || depth - pops + pushes > chunk->max_stack)
+        {
+            return reject(&verifier, offset, "Stack deeper than the chunk's maximum.");
+        }
+
+        depth += pushes - pops;
+        offset += length;
+    }
+
+    chunk->verified = true;
+    return true;
+}
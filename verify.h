@@ -0,0 +1,18 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "chunk.h"
+
+typedef struct
+{
+    int offset;
+    const char *message;
+} VerifyError;
+
+// Checks that every instruction is a known opcode whose operands are in
+// range and that the stack never underflows or grows past the chunk's
+// max_stack, so run() can execute the chunk without checking any of that
+// itself. On failure error, if given, says what was wrong and where.
+bool verify_chunk(VM *vm, Chunk *chunk, VerifyError *error);
+
+#endif
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include "vm.h"
 #include "value.h"
@@ -7,49 +8,139 @@
 #include "compiler.h"
 #include "object.h"
 #include "memory.h"
+#include "profile.h"
 #include "table.h"
+#include "verify.h"
 
-VM vm;
+static void reset_stack(VM *vm)
+{
+    vm->stack_top = vm->stack;
+}
+
+static void *system_realloc(void *ptr, size_t old_size, size_t new_size, void *user_data)
+{
+    (void)old_size;
+    (void)user_data;
+
+    if (new_size == 0)
+    {
+        free(ptr);
+        return NULL;
+    }
+
+    return realloc(ptr, new_size);
+}
+
+bool vm_init(VM *vm, const VmAllocator *allocator)
+{
+    if (allocator != NULL)
+    {
+        vm->allocator = *allocator;
+    }
+    else
+    {
+        vm->allocator.realloc = system_realloc;
+        vm->allocator.reset = NULL;
+        vm->allocator.user_data = NULL;
+    }
 
-static void reset_stack()
+    vm->out_of_memory = NULL;
+    memory_stats_init(&vm->memory);
+    vm->heap_profile = NULL;
+    vm->profile = NULL;
+    vm->stack = (Value *)raw_reallocate(vm, MEMORY_STACK, NULL, 0, sizeof(Value) * STACK_INITIAL);
+    vm->stack_capacity = vm->stack != NULL ? STACK_INITIAL : 0;
+    table_init(&vm->global_names);
+    value_array_init(&vm->global_values);
+    table_init(&vm->strings);
+    reset_stack(vm);
+    vm->chunk = NULL;
+    vm->ip = NULL;
+    heap_init(&vm->heap, vm);
+    vm->bytes_allocated = 0;
+    vm->next_gc = 1024 * 1024;
+    vm->gray_count = 0;
+    vm->gray_capacity = 0;
+    vm->gray_stack = NULL;
+    vm->compiler = NULL;
+    vm->scripts = NULL;
+    vm->print = NULL;
+    vm->print_data = NULL;
+
+    return vm->stack != NULL;
+}
+
+void vm_free(VM *vm)
 {
-    vm.stack_top = vm.stack;
-    table_init(&vm.strings);
+    table_free(vm, &vm->global_names);
+    value_array_free(vm, MEMORY_TABLES, &vm->global_values);
+    table_free(vm, &vm->strings);
+
+    while (vm->scripts != NULL)
+    {
+        VmScript *next = vm->scripts->next;
+        chunk_free(vm, &vm->scripts->chunk);
+        raw_reallocate(vm, MEMORY_OTHER, vm->scripts, sizeof(VmScript), 0);
+        vm->scripts = next;
+    }
+
+    free_objects(vm);
+    raw_reallocate(vm, MEMORY_STACK, vm->stack, sizeof(Value) * vm->stack_capacity, 0);
 }
 
-void vm_init()
+int vm_global_slot(VM *vm, ObjString *name)
 {
-    table_init(&vm.globals);
-    table_init(&vm.strings);
-    reset_stack();
-    vm.objects = NULL;
+    Value slot;
+
+    if (table_get(&vm->global_names, name, &slot))
+    {
+        return (int)AS_NUMBER(slot);
+    }
+
+    int index = vm->global_values.count;
+
+    push(vm, OBJ_VAL(name));
+    value_array_write(vm, MEMORY_TABLES, &vm->global_values, UNDEFINED_VAL);
+    table_set(vm, &vm->global_names, name, NUMBER_VAL((double)index));
+    pop(vm);
+
+    return index;
 }
 
-void vm_free()
+ObjString *vm_global_name(VM *vm, int slot)
 {
-    table_free(&vm.globals);
-    table_free(&vm.strings);
-    free_objects();
+    // Only used for error messages and disassembly, so a scan is fine.
+    for (int i = 0; i < vm->global_names.capacity; i++)
+    {
+        Entry *entry = &vm->global_names.entries[i];
+
+        if (entry->key != NULL && (int)AS_NUMBER(entry->value) == slot)
+        {
+            return entry->key;
+        }
+    }
+
+    return NULL;
 }
 
-void push(Value value)
+void push(VM *vm, Value value)
 {
-    *vm.stack_top = value;
-    vm.stack_top++;
+    *vm->stack_top = value;
+    vm->stack_top++;
 }
 
-Value pop()
+Value pop(VM *vm)
 {
-    vm.stack_top--;
-    return *vm.stack_top;
+    vm->stack_top--;
+    return *vm->stack_top;
 }
 
-static Value peek(int distance)
+static Value peek(VM *vm, int distance)
 {
-    return vm.stack_top[-1 - distance];
+    return vm->stack_top[-1 - distance];
 }
 
-static void runtime_error(const char *format, ...)
+static void runtime_error(VM *vm, const char *format, ...)
 {
     va_list args;
     va_start(args, format);
@@ -57,11 +148,11 @@ static void runtime_error(const char *format, ...)
     va_end(args);
     fputs("\n", stderr);
 
-    size_t instruction = vm.ip - vm.chunk->code - 1;
-    int line = vm.chunk->lines[instruction];
+    size_t instruction = vm->ip - vm->chunk->code - 1;
+    int line = chunk_get_line(vm->chunk, (int)instruction);
     fprintf(stderr, "[line %d] in script\n", line);
 
-    reset_stack();
+    reset_stack(vm);
 }
 
 static bool is_falsey(Value value)
@@ -69,183 +160,230 @@ static bool is_falsey(Value value)
     return IS_NONE(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate()
+static void concatenate(VM *vm)
+{
+    // Leave the operands on the stack until the result exists so a
+    // collection triggered by the allocation can't free them.
+    Obj *result = concatenate_ropes(vm, AS_OBJ(peek(vm, 1)), AS_OBJ(peek(vm, 0)));
+    pop(vm);
+    pop(vm);
+    push(vm, OBJ_VAL(result));
+}
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void trace_execution(VM *vm)
+{
+    printf("          ");
+    for (Value *slot = vm->stack; slot < vm->stack_top; slot++)
+    {
+        printf("[ ");
+        value_print(vm, *slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassemble_instruction(vm, vm->chunk, (int)(vm->ip - vm->chunk->code));
+}
+#define TRACE_EXECUTION() trace_execution(vm)
+#else
+#define TRACE_EXECUTION() ((void)0)
+#endif
+
+// Pops and compares the top two values. They stay on the stack during the
+// comparison since comparing ropes flattens them, which can collect.
+static bool pop_equal(VM *vm)
 {
-    ObjString *b = AS_STRING(pop());
-    ObjString *a = AS_STRING(pop());
+    bool equal = values_equal(vm, peek(vm, 1), peek(vm, 0));
+    pop(vm);
+    pop(vm);
+    return equal;
+}
 
-    int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+static bool add(VM *vm)
+{
+    if (IS_STRING_LIKE(peek(vm, 0)) && IS_STRING_LIKE(peek(vm, 1)))
+    {
+        concatenate(vm);
+    }
+    else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))
+    {
+        double b = AS_NUMBER(pop(vm));
+        double a = AS_NUMBER(pop(vm));
+        push(vm, NUMBER_VAL(a + b));
+    }
+    else
+    {
+        runtime_error(vm, "Operands must be two numbers or two strings.");
+        return false;
+    }
 
-    ObjString *result = take_string(chars, length);
-    push(OBJ_VAL(result));
+    return true;
 }
 
-static InterpretResult run()
+// Replaces the top count values with their left-to-right sum. All numbers are
+// summed directly and all flat strings are joined with a single allocation.
+// Anything else is added pairwise so mixed operands behave like OP_ADD.
+static bool concatenate_n(VM *vm, int count)
 {
-#define READ_BYTE() (*vm.ip++)
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(value_type, op)                       \
-    do                                                  \
-    {                                                   \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
-        {                                               \
-            runtime_error("Operands must be numbers."); \
-            return INTERPRET_RUNTIME_ERROR;             \
-        }                                               \
-        double b = AS_NUMBER(pop());                    \
-        double a = AS_NUMBER(pop());                    \
-        push(value_type(a op b));                       \
-    } while (false)
+    Value *operands = vm->stack_top - count;
+    int length = 0;
+    bool flat = true;
+    bool numbers = true;
 
-    for (;;)
+    for (int i = 0; i < count; i++)
     {
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value *slot = vm.stack; slot < vm.stack_top; slot++)
-        {
-            printf("[ ");
-            value_print(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassemble_instruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
-#endif
+        flat = flat && IS_STRING(operands[i]);
+        numbers = numbers && IS_NUMBER(operands[i]);
+        if (flat)
+            length += AS_STRING(operands[i])->length;
+    }
 
-        uint8_t instruction;
-        switch (instruction = READ_BYTE())
-        {
-        case OP_CONSTANT:
+    if (numbers)
+    {
+        double sum = AS_NUMBER(operands[0]);
+        for (int i = 1; i < count; i++)
         {
-            Value constant = READ_CONSTANT();
-            push(constant);
-            break;
+            sum += AS_NUMBER(operands[i]);
         }
-        case OP_NONE:
-            push(NONE_VAL);
-            break;
-        case OP_TRUE:
-            push(BOOL_VAL(true));
-            break;
-        case OP_FALSE:
-            push(BOOL_VAL(false));
-            break;
-        case OP_POP:
-            pop();
-            break;
-        case OP_GET_GLOBAL:
-        {
-            ObjString *name = READ_STRING();
-            Value value;
 
-            if (!table_get(&vm.globals, name, &value))
-            {
-                runtime_error("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
+        vm->stack_top = operands;
+        push(vm, NUMBER_VAL(sum));
+        return true;
+    }
 
-            push(value);
-            break;
-        }
-        case OP_DEFINE_GLOBAL:
-        {
-            ObjString *name = READ_STRING();
-            table_set(&vm.globals, name, peek(0));
-            pop();
-            break;
-        }
-        case OP_EQUAL:
+    if (flat)
+    {
+        ObjString *result = allocate_string(vm, length);
+        int offset = 0;
+
+        for (int i = 0; i < count; i++)
         {
-            Value b = pop();
-            Value a = pop();
-            push(BOOL_VAL(values_equal(a, b)));
-            break;
+            ObjString *string = AS_STRING(operands[i]);
+            memcpy(result->chars + offset, string->chars, string->length);
+            offset += string->length;
         }
-        case OP_GREATER:
-            BINARY_OP(BOOL_VAL, >);
-            break;
-        case OP_LESS:
-            BINARY_OP(BOOL_VAL, <);
-            break;
-        case OP_ADD:
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
-            {
-                concatenate();
-            }
-            else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
-            {
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a + b));
-            }
-            else
-            {
-                runtime_error("Operands must be two numbers or two strings.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-
-            break;
-        case OP_SUBTRACT:
-            BINARY_OP(NUMBER_VAL, -);
-            break;
-        case OP_MULTIPLY:
-            BINARY_OP(NUMBER_VAL, *);
-            break;
-        case OP_DIVIDE:
-            BINARY_OP(NUMBER_VAL, /);
-            break;
-        case OP_NOT:
-            push(BOOL_VAL(is_falsey(pop())));
-            break;
-        case OP_NEGATE:
+
+        vm->stack_top = operands;
+        push(vm, OBJ_VAL(result));
+        return true;
+    }
+
+    // Operands stay on the stack beneath the pair being added.
+    for (int i = 1; i < count; i++)
+    {
+        push(vm, operands[0]);
+        push(vm, operands[i]);
+        if (!add(vm))
+            return false;
+        operands[0] = pop(vm);
+    }
+
+    vm->stack_top = operands + 1;
+    return true;
+}
+
+#define RUN_NAME run
+#define PROFILE_INSTRUCTION() ((void)0)
+#include "vm_loop.h"
+
+#define RUN_NAME run_profiled
+#define PROFILE_INSTRUCTION() profile_instruction(vm->profile, vm->chunk, vm->ip)
+#include "vm_loop.h"
+
+// The stack bypasses reallocate(), like the gray stack, so growing it never
+// triggers a collection.
+static void grow_stack(VM *vm, int needed)
+{
+    int depth = (int)(vm->stack_top - vm->stack);
+    int capacity = vm->stack_capacity * 2 > needed ? vm->stack_capacity * 2 : needed;
+    Value *stack = (Value *)raw_reallocate(vm, MEMORY_STACK, vm->stack, sizeof(Value) * vm->stack_capacity,
+                                           sizeof(Value) * capacity);
+
+    if (stack == NULL)
+        out_of_memory(vm);
+
+    vm->stack = stack;
+    vm->stack_top = stack + depth;
+    vm->stack_capacity = capacity;
+}
+
+InterpretResult interpret_chunk(VM *vm, Chunk *chunk)
+{
+    VerifyError error;
+
+    if (!chunk->verified && !verify_chunk(vm, chunk, &error))
+    {
+        fprintf(stderr, "Invalid bytecode at offset %d: %s\n", error.offset, error.message);
+        return INTERPRET_COMPILE_ERROR;
+    }
+
+    // Running out of memory anywhere below unwinds back here. Runs can nest
+    // inside a host's own recovery point, so the outer one is restored.
+    jmp_buf recover;
+    jmp_buf *outer = vm->out_of_memory;
+    InterpretResult result;
+
+    vm->out_of_memory = &recover;
+
+    if (setjmp(recover) == 0)
+    {
+        // The verifier has checked the chunk never goes deeper than
+        // max_stack, so making room once here means push() never has to
+        // check.
+        int needed = (int)(vm->stack_top - vm->stack) + chunk->max_stack;
+
+        if (needed > vm->stack_capacity)
         {
-            if (!IS_NUMBER(peek(0)))
-            {
-                runtime_error("Operand must be a number.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
-            break;
+            grow_stack(vm, needed);
         }
-        case OP_PRINT:
+
+        vm->chunk = chunk;
+        vm->ip = vm->chunk->code;
+
+        // Choosing the loop once per run keeps profiling out of run().
+        if (vm->profile != NULL && profile_begin_run(vm->profile, chunk))
         {
-            value_print(pop());
-            printf("\n");
-            break;
+            result = run_profiled(vm);
         }
-        case OP_RETURN:
+        else
         {
-            return INTERPRET_OK;
-        }
+            result = run(vm);
         }
     }
+    else if (vm->chunk != NULL)
+    {
+        runtime_error(vm, "%s", memory_error(vm));
+        result = INTERPRET_RUNTIME_ERROR;
+    }
+    else
+    {
+        fprintf(stderr, "%s\n", memory_error(vm));
+        reset_stack(vm);
+        result = INTERPRET_RUNTIME_ERROR;
+    }
 
-#undef READ_BYTE
-#undef READ_CONSTANT
-#undef READ_STRING
-#undef BINARY_OP
+    if (vm->profile != NULL)
+    {
+        profile_end_run(vm->profile);
+    }
+
+    vm->out_of_memory = outer;
+    vm->chunk = NULL;
+    vm->ip = NULL;
+    return result;
 }
 
-InterpretResult interpret(const char *source)
+InterpretResult interpret(VM *vm, const char *source)
 {
     Chunk chunk;
     chunk_init(&chunk);
 
-    if (!compile(source, &chunk))
+    if (!compile(vm, source, &chunk))
     {
-        chunk_free(&chunk);
+        chunk_free(vm, &chunk);
         return INTERPRET_COMPILE_ERROR;
     }
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
-
-    InterpretResult result = run();
-
-    chunk_free(&chunk);
+    InterpretResult result = interpret_chunk(vm, &chunk);
+    chunk_free(vm, &chunk);
     return result;
 }
\ No newline at end of file
@@ -1,37 +1,78 @@
 #ifndef VM_H
 #define VM_H
 
+#include <setjmp.h>
+
 #include "chunk.h"
+#include "heap.h"
+#include "libvm.h"
+#include "memory.h"
 #include "table.h"
 
-#define STACK_MAX 256
+#define STACK_INITIAL 256
+
+// Global slots that have been resolved by the compiler but not yet defined.
+#define UNDEFINED_VAL OBJ_VAL(NULL)
+#define IS_UNDEFINED(value) (IS_OBJ(value) && AS_OBJ(value) == NULL)
 
-typedef struct
+// A chunk compiled for the host. The VM keeps a list of them so their
+// constants stay reachable between runs.
+struct VmScript
 {
+    Chunk chunk;
+    struct VmScript *next;
+};
+
+struct VM
+{
+    VmAllocator allocator;
+    // Where out_of_memory() unwinds to: set by whatever compile or run is in
+    // progress, NULL otherwise.
+    jmp_buf *out_of_memory;
+    MemoryStats memory;
+    // Set by a host that wants allocations sampled.
+    struct HeapProfile *heap_profile;
+    // Set by a host that wants execution profiled.
+    struct Profile *profile;
     Chunk *chunk;
+    // Points into chunk's code while it runs, NULL otherwise. The cache sets
+    // chunk without running it.
     uint8_t *ip;
-    Value stack[STACK_MAX];
+    Value *stack;
     Value *stack_top;
-    Table globals;
+    int stack_capacity;
+    Table global_names;
+    ValueArray global_values;
     Table strings;
-    Obj *objects;
-} VM;
+    Heap heap;
+    size_t bytes_allocated;
+    size_t next_gc;
+    int gray_count;
+    int gray_capacity;
+    Obj **gray_stack;
+    // The compiler working on this VM's behalf, whose constants are roots.
+    struct Compiler *compiler;
+    VmScript *scripts;
+    VmPrintFn print;
+    void *print_data;
+};
 
-void push(Value value);
-Value pop();
+void push(VM *vm, Value value);
+Value pop(VM *vm);
 
-extern VM vm;
+// A NULL allocator means the system one. Fails only if the stack can't be
+// allocated, and the VM must still be freed.
+bool vm_init(VM *vm, const VmAllocator *allocator);
+void vm_free(VM *vm);
 
-void vm_init();
-void vm_free();
+int vm_global_slot(VM *vm, ObjString *name);
+ObjString *vm_global_name(VM *vm, int slot);
 
-typedef enum
-{
-    INTERPRET_OK,
-    INTERPRET_COMPILE_ERROR,
-    INTERPRET_RUNTIME_ERROR,
-} InterpretResult;
+InterpretResult interpret(VM *vm, const char *source);
+InterpretResult interpret_chunk(VM *vm, Chunk *chunk);
 
-InterpretResult interpret(const char *source);
+// Converts a value for the host. Flattening a rope allocates, so the value
+// must be reachable.
+VmValue value_to_host(VM *vm, Value value);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,403 @@
+// The body of the interpreter loop, included twice by vm.c: once as run()
+// and once, with PROFILE_INSTRUCTION() counting every instruction, as
+// run_profiled(), so the plain loop carries no profiling code at all.
+//
+// Expects RUN_NAME and PROFILE_INSTRUCTION() to be defined, and undefines
+// both.
+
+// Operands and stack depth are trusted here: interpret_chunk() only runs
+// chunks verify_chunk() has accepted.
+static InterpretResult RUN_NAME(VM *vm)
+{
+#define READ_BYTE() (*vm->ip++)
+#define READ_LONG() (vm->ip += 3, (vm->ip[-3] << 16) | (vm->ip[-2] << 8) | vm->ip[-1])
+#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
+#define READ_CONSTANT_LONG() (vm->chunk->constants.values[READ_LONG()])
+#define BINARY_OP(value_type, op)                       \
+    do                                                  \
+    {                                                   \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) \
+        {                                               \
+            runtime_error(vm, "Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR;             \
+        }                                               \
+        double b = AS_NUMBER(pop(vm));                    \
+        double a = AS_NUMBER(pop(vm));                    \
+        push(vm, value_type(a op b));                       \
+    } while (false)
+#define BINARY_CONSTANT_OP(op)                            \
+    do                                                    \
+    {                                                     \
+        Value b = READ_CONSTANT();                        \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(b))         \
+        {                                                 \
+            runtime_error(vm, "Operands must be numbers.");   \
+            return INTERPRET_RUNTIME_ERROR;               \
+        }                                                 \
+        double a = AS_NUMBER(peek(vm, 0));                    \
+        vm->stack_top[-1] = NUMBER_VAL(a op AS_NUMBER(b)); \
+    } while (false)
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+// Rewrites the single-byte instruction being executed. Generic opcodes
+// specialise themselves for the operand types they first see, and the
+// specialised forms rewrite back to the generic one when their guard fails.
+#define QUICKEN(op) (vm->ip[-1] = (op))
+#define BOTH_NUMBERS() (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))
+#define BOTH_STRINGS() (IS_STRING_LIKE(peek(vm, 0)) && IS_STRING_LIKE(peek(vm, 1)))
+
+// Handlers are written once against CASE/NEXT. With COMPUTED_GOTO every
+// handler ends in its own indirect jump through dispatch_table, otherwise
+// they become the arms of a switch inside the dispatch loop.
+#ifdef COMPUTED_GOTO
+    static void *dispatch_table[] = {
+        [OP_CONSTANT] = &&L_OP_CONSTANT,
+        [OP_NONE] = &&L_OP_NONE,
+        [OP_TRUE] = &&L_OP_TRUE,
+        [OP_FALSE] = &&L_OP_FALSE,
+        [OP_EQUAL] = &&L_OP_EQUAL,
+        [OP_GREATER] = &&L_OP_GREATER,
+        [OP_LESS] = &&L_OP_LESS,
+        [OP_ADD] = &&L_OP_ADD,
+        [OP_SUBTRACT] = &&L_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&L_OP_MULTIPLY,
+        [OP_DIVIDE] = &&L_OP_DIVIDE,
+        [OP_NOT] = &&L_OP_NOT,
+        [OP_NEGATE] = &&L_OP_NEGATE,
+        [OP_RETURN] = &&L_OP_RETURN,
+        [OP_PRINT] = &&L_OP_PRINT,
+        [OP_POP] = &&L_OP_POP,
+        [OP_DEFINE_GLOBAL] = &&L_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL] = &&L_OP_GET_GLOBAL,
+        [OP_CONSTANT_LONG] = &&L_OP_CONSTANT_LONG,
+        [OP_DEFINE_GLOBAL_LONG] = &&L_OP_DEFINE_GLOBAL_LONG,
+        [OP_GET_GLOBAL_LONG] = &&L_OP_GET_GLOBAL_LONG,
+        [OP_NOT_EQUAL] = &&L_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL] = &&L_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL] = &&L_OP_LESS_EQUAL,
+        [OP_ADD_CONSTANT] = &&L_OP_ADD_CONSTANT,
+        [OP_SUBTRACT_CONSTANT] = &&L_OP_SUBTRACT_CONSTANT,
+        [OP_MULTIPLY_CONSTANT] = &&L_OP_MULTIPLY_CONSTANT,
+        [OP_DIVIDE_CONSTANT] = &&L_OP_DIVIDE_CONSTANT,
+        [OP_CONCAT_N] = &&L_OP_CONCAT_N,
+        [OP_ADD_NUM] = &&L_OP_ADD_NUM,
+        [OP_ADD_STR] = &&L_OP_ADD_STR,
+        [OP_EQUAL_NUM] = &&L_OP_EQUAL_NUM,
+        [OP_NOT_EQUAL_NUM] = &&L_OP_NOT_EQUAL_NUM,
+    };
+
+#define DISPATCH()                          \
+    do                                      \
+    {                                       \
+        TRACE_EXECUTION();                  \
+        PROFILE_INSTRUCTION();              \
+        goto *dispatch_table[READ_BYTE()];  \
+    } while (false)
+#define CASE(op) L_##op:
+#define NEXT() DISPATCH()
+
+    DISPATCH();
+#else
+#define CASE(op) case op:
+#define NEXT() break
+
+    for (;;)
+    {
+        TRACE_EXECUTION();
+        PROFILE_INSTRUCTION();
+
+        switch (READ_BYTE())
+        {
+#endif
+        CASE(OP_CONSTANT)
+        {
+            Value constant = READ_CONSTANT();
+            push(vm, constant);
+            NEXT();
+        }
+        CASE(OP_CONSTANT_LONG)
+        {
+            Value constant = READ_CONSTANT_LONG();
+            push(vm, constant);
+            NEXT();
+        }
+        CASE(OP_NONE)
+        {
+            push(vm, NONE_VAL);
+            NEXT();
+        }
+        CASE(OP_TRUE)
+        {
+            push(vm, BOOL_VAL(true));
+            NEXT();
+        }
+        CASE(OP_FALSE)
+        {
+            push(vm, BOOL_VAL(false));
+            NEXT();
+        }
+        CASE(OP_POP)
+        {
+            pop(vm);
+            NEXT();
+        }
+        CASE(OP_GET_GLOBAL)
+        {
+            uint8_t slot = READ_BYTE();
+            Value value = vm->global_values.values[slot];
+
+            if (IS_UNDEFINED(value))
+            {
+                runtime_error(vm, "Undefined variable '%s'.", vm_global_name(vm, slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            push(vm, value);
+            NEXT();
+        }
+        CASE(OP_DEFINE_GLOBAL)
+        {
+            uint8_t slot = READ_BYTE();
+            vm->global_values.values[slot] = pop(vm);
+            NEXT();
+        }
+        CASE(OP_GET_GLOBAL_LONG)
+        {
+            int slot = READ_LONG();
+            Value value = vm->global_values.values[slot];
+
+            if (IS_UNDEFINED(value))
+            {
+                runtime_error(vm, "Undefined variable '%s'.", vm_global_name(vm, slot)->chars);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            push(vm, value);
+            NEXT();
+        }
+        CASE(OP_DEFINE_GLOBAL_LONG)
+        {
+            int slot = READ_LONG();
+            vm->global_values.values[slot] = pop(vm);
+            NEXT();
+        }
+        CASE(OP_EQUAL)
+        {
+            if (BOTH_NUMBERS())
+            {
+                QUICKEN(OP_EQUAL_NUM);
+            }
+            push(vm, BOOL_VAL(pop_equal(vm)));
+            NEXT();
+        }
+        CASE(OP_GREATER)
+        {
+            BINARY_OP(BOOL_VAL, >);
+            NEXT();
+        }
+        CASE(OP_LESS)
+        {
+            BINARY_OP(BOOL_VAL, <);
+            NEXT();
+        }
+        CASE(OP_ADD)
+        {
+            if (BOTH_NUMBERS())
+            {
+                QUICKEN(OP_ADD_NUM);
+            }
+            else if (BOTH_STRINGS())
+            {
+                QUICKEN(OP_ADD_STR);
+            }
+            if (!add(vm))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            NEXT();
+        }
+        CASE(OP_SUBTRACT)
+        {
+            BINARY_OP(NUMBER_VAL, -);
+            NEXT();
+        }
+        CASE(OP_MULTIPLY)
+        {
+            BINARY_OP(NUMBER_VAL, *);
+            NEXT();
+        }
+        CASE(OP_DIVIDE)
+        {
+            BINARY_OP(NUMBER_VAL, /);
+            NEXT();
+        }
+        CASE(OP_NOT)
+        {
+            push(vm, BOOL_VAL(is_falsey(pop(vm))));
+            NEXT();
+        }
+        CASE(OP_NEGATE)
+        {
+            if (!IS_NUMBER(peek(vm, 0)))
+            {
+                runtime_error(vm, "Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
+            NEXT();
+        }
+        CASE(OP_PRINT)
+        {
+            // Printing may flatten a rope, so only pop once it's done.
+            if (vm->print != NULL)
+            {
+                vm->print(value_to_host(vm, peek(vm, 0)), vm->print_data);
+            }
+            else
+            {
+                value_print(vm, peek(vm, 0));
+                printf("\n");
+            }
+            pop(vm);
+            NEXT();
+        }
+        CASE(OP_RETURN)
+        {
+            return INTERPRET_OK;
+        }
+        CASE(OP_NOT_EQUAL)
+        {
+            if (BOTH_NUMBERS())
+            {
+                QUICKEN(OP_NOT_EQUAL_NUM);
+            }
+            push(vm, BOOL_VAL(!pop_equal(vm)));
+            NEXT();
+        }
+        CASE(OP_GREATER_EQUAL)
+        {
+            // Fused OP_LESS, OP_NOT: keep !(a < b) so NaN compares the same.
+            BINARY_OP(NOT_BOOL_VAL, <);
+            NEXT();
+        }
+        CASE(OP_LESS_EQUAL)
+        {
+            BINARY_OP(NOT_BOOL_VAL, >);
+            NEXT();
+        }
+        CASE(OP_ADD_CONSTANT)
+        {
+            Value b = READ_CONSTANT();
+            if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(b))
+            {
+                vm->stack_top[-1] = NUMBER_VAL(AS_NUMBER(peek(vm, 0)) + AS_NUMBER(b));
+            }
+            else
+            {
+                push(vm, b);
+                if (!add(vm))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+            }
+            NEXT();
+        }
+        CASE(OP_SUBTRACT_CONSTANT)
+        {
+            BINARY_CONSTANT_OP(-);
+            NEXT();
+        }
+        CASE(OP_MULTIPLY_CONSTANT)
+        {
+            BINARY_CONSTANT_OP(*);
+            NEXT();
+        }
+        CASE(OP_DIVIDE_CONSTANT)
+        {
+            BINARY_CONSTANT_OP(/);
+            NEXT();
+        }
+        CASE(OP_CONCAT_N)
+        {
+            if (!concatenate_n(vm, READ_BYTE()))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            NEXT();
+        }
+        CASE(OP_ADD_NUM)
+        {
+            if (!BOTH_NUMBERS())
+            {
+                QUICKEN(OP_ADD);
+                if (!add(vm))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                NEXT();
+            }
+            double b = AS_NUMBER(pop(vm));
+            vm->stack_top[-1] = NUMBER_VAL(AS_NUMBER(peek(vm, 0)) + b);
+            NEXT();
+        }
+        CASE(OP_ADD_STR)
+        {
+            if (!BOTH_STRINGS())
+            {
+                QUICKEN(OP_ADD);
+                if (!add(vm))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                NEXT();
+            }
+            concatenate(vm);
+            NEXT();
+        }
+        CASE(OP_EQUAL_NUM)
+        {
+            if (!BOTH_NUMBERS())
+            {
+                QUICKEN(OP_EQUAL);
+                push(vm, BOOL_VAL(pop_equal(vm)));
+                NEXT();
+            }
+            double b = AS_NUMBER(pop(vm));
+            vm->stack_top[-1] = BOOL_VAL(AS_NUMBER(peek(vm, 0)) == b);
+            NEXT();
+        }
+        CASE(OP_NOT_EQUAL_NUM)
+        {
+            if (!BOTH_NUMBERS())
+            {
+                QUICKEN(OP_NOT_EQUAL);
+                push(vm, BOOL_VAL(!pop_equal(vm)));
+                NEXT();
+            }
+            double b = AS_NUMBER(pop(vm));
+            vm->stack_top[-1] = BOOL_VAL(AS_NUMBER(peek(vm, 0)) != b);
+            NEXT();
+        }
+#ifndef COMPUTED_GOTO
+        }
+    }
+#endif
+
+#undef READ_BYTE
+#undef READ_LONG
+#undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
+#undef BINARY_OP
+#undef BINARY_CONSTANT_OP
+#undef NOT_BOOL_VAL
+#undef QUICKEN
+#undef BOTH_NUMBERS
+#undef BOTH_STRINGS
+#undef CASE
+#undef NEXT
+#ifdef COMPUTED_GOTO
+#undef DISPATCH
+#endif
+}
+
+#undef RUN_NAME
+#undef PROFILE_INSTRUCTION